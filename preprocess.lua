@@ -42,3 +42,14 @@ if os.getenv('DLOPEN_COVERAGE') then
     util.printout("CFLAGS: " .. variables.CFLAGS)
     util.printout("LIBFLAG: " .. variables.LIBFLAG)
 end
+
+if os.getenv('DLOPEN_JIT') then
+    -- Enable machine code call thunks (x86-64 only)
+    local variables = rockspec.variables
+    variables.CFLAGS = table.concat({
+        variables.CFLAGS,
+        '-DDLOPEN_USE_JIT',
+    }, ' ')
+    util.printout("Enabling DLOPEN_JIT flag...")
+    util.printout("CFLAGS: " .. variables.CFLAGS)
+end
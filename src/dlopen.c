@@ -22,15 +22,35 @@
 #include "./config.h"
 // POSIX
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <ffi.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 // Lua
 #include <lauxlib.h>
 #include <lua.h>
 
-#define MODULE_MT "dlopen"
+#if LUA_VERSION_NUM < 502
+# define lua_rawlen(L, idx) lua_objlen(L, idx)
+#endif
+
+#define MODULE_MT         "dlopen"
+#define MODULE_METHODS_MT "dlopen.methods"
+#define STRUCT_MT         "dlopen.struct"
+#define STRUCT_TYPES      "dlopen.structs"
+#define BUFFER_MT         "dlopen.buffer"
+#define ARRAY_MT          "dlopen.array"
+#define CALLBACK_MT       "dlopen.callback"
+#define ERRNO_SLOT        "dlopen.errno"
+#define CALLER_SLOT       "dlopen.caller"
 
 #define FFI_MAX_ARGS 32
 
@@ -61,35 +81,226 @@ typedef enum {
     T_DOUBLE,
     T_SIZE_T,
     T_SSIZE_T,
+    // a Lua string passed as the pointer and the size_t length arguments
+    T_BYTES,
+    // pointer to the output value. the type is specified by appending '*'
+    // (output only) or '&' (input and output) to the name of the value type.
+    T_OUT,
+    T_INOUT,
+    // struct passed by value, defined by dlopen.defstruct
+    T_STRUCT,
 
     // sentinel value - must be last
     // used for array sizing and iteration bounds
     T_LAST,
 } datatype_t;
 
+typedef union {
+    void *p;
+    int8_t i8;
+    uint8_t u8;
+    int16_t i16;
+    uint16_t u16;
+    int32_t i32;
+    uint32_t u32;
+    int64_t i64;
+    uint64_t u64;
+    char c;
+    signed char sc;
+    unsigned char uc;
+    short s;
+    unsigned short us;
+    int i;
+    unsigned int ui;
+    long l;
+    unsigned long ul;
+    long long ll;
+    unsigned long long ull;
+    float f;
+    double d;
+    size_t sz;
+    ssize_t ssz;
+} callval_u;
+
+// converts the Lua value at idx to the argument value of the C function
+typedef void (*toarg_t)(lua_State *L, int idx, int argn, callval_u *val);
+// pushes the return value of the C function and returns the number of values
+typedef int (*pushret_t)(lua_State *L, callval_u *val);
+// calls the C function directly without ffi_call
+typedef void (*symstub_t)(void *fn, callval_u *retval, callval_u *args);
+
 typedef struct syminfo_st syminfo_t;
+typedef struct dso_st dso_t;
+typedef struct signature_st signature_t;
+typedef struct structdef_st structdef_t;
+typedef struct varcif_st varcif_t;
 
-struct syminfo_st {
-    int ref;
-    void *addr;
-    syminfo_t *next;
-    // function signature for FFI calls
-    size_t len;
-    char *name;
-    datatype_t ret_type;
-    ffi_type *ret_ffi_type;
+typedef struct {
+    const char *name;
+    datatype_t type;
+    structdef_t *def; // type of the nested struct, or NULL
+    size_t offset;
+} structfield_t;
+
+// struct type defined by dlopen.defstruct. the layout is computed once at
+// the definition. the fields, the elements and the names are allocated in
+// the same block.
+struct structdef_st {
+    ffi_type type; // FFI_TYPE_STRUCT
+    const char *name;
+    size_t nfields;
+    structfield_t fields[];
+};
+
+// symbol options specified by the options table of dlsym
+enum {
+    SYM_UNCHECKED = 1 << 0, // skip the type validation of the arguments
+    SYM_STRUCT    = 1 << 1, // takes or returns the struct values
+    SYM_VARIADIC  = 1 << 2, // declared with the trailing '...'
+    SYM_ERRNO     = 1 << 3, // capture errno right after the call
+    SYM_NAMEBLOCK = 1 << 4, // name is stored in the nameblock of the dso
+    SYM_LAZY      = 1 << 5, // resolved on the first call
+};
+
+// call interface of the variadic function for the types of the variadic
+// arguments, cached in the syminfo by the types
+struct varcif_st {
+    varcif_t *next;
+    size_t ntail;                      // number of the variadic arguments
+    datatype_t types[FFI_MAX_ARGS];    // promoted type of each argument
+    toarg_t toargs[FFI_MAX_ARGS];      // converter of each variadic argument
+    ffi_type *ffi_types[FFI_MAX_ARGS]; // fixed and variadic argument types
+    ffi_cif cif;
+};
+
+// function signature for FFI calls. the identical signatures are interned
+// in the process-wide table and shared by the symbols, so they must not be
+// modified once interned.
+struct signature_st {
+    // key of the intern table, compared as the bytes
     size_t nargs;
+    unsigned int flags; // SYM_UNCHECKED, SYM_STRUCT and SYM_VARIADIC
+    datatype_t ret_type;
+    int lenarg; // C argument index of the retlen output argument, or -1
     datatype_t arg_types[FFI_MAX_ARGS];
+    datatype_t arg_bases[FFI_MAX_ARGS]; // value type of output arguments
+    // derived from the key
+    signature_t *next; // next entry in the bucket of the intern table
+    size_t refs;
+    ffi_type *ret_ffi_type;
+    structdef_t *arg_structs[FFI_MAX_ARGS]; // struct type of the arguments
+    structdef_t *ret_struct;               // struct type of the return value
+    size_t scratch; // size of the storage of the struct values
     ffi_type *arg_ffi_types[FFI_MAX_ARGS]; // must remain valid for cif
     ffi_cif cif;
+    // marshaling plan compiled from the signature by dlsym
+    pushret_t pushret;
+    size_t nparams;                   // number of arguments passed from Lua
+    toarg_t toargs[FFI_MAX_ARGS];     // converter of each Lua argument
+    uint8_t slots[FFI_MAX_ARGS];      // argument value index of each argument
+    size_t nouts;                     // number of output arguments
+    uint8_t outs[FFI_MAX_ARGS];       // C argument index of output arguments
+    pushret_t pushouts[FFI_MAX_ARGS]; // pusher of each output value
+    // length of the returned string, see the retlen option of dlsym
+    int lenout; // index of outs that receives the length, or -1
+};
+
+#define SIGNATURE_KEYLEN                                                       \
+    (offsetof(signature_t, arg_bases) + sizeof(datatype_t) * FFI_MAX_ARGS)
+
+// per-state slot of the thread that calls the C functions, so that the
+// callbacks run on the thread that calls them
+typedef struct {
+    lua_State *thread; // thread in the call of a C function, or NULL
+    lua_State *main;   // thread to run the callbacks called outside a call
+    int err;           // reference to the error raised by a callback
+} caller_t;
+
+struct syminfo_st {
+    int ref; // reference to the call closure bound to this symbol
+    void *addr;
+    syminfo_t *next;
+    unsigned int flags;
+    char *name;
+    signature_t *sig;  // shared signature
+    syminfo_t *lensym; // symbol that returns the length, or NULL
+    symstub_t stub;    // NULL if the symbol must be called via ffi_call
+    varcif_t *varcifs; // cached call interfaces of the variadic function
+    int *errslot;      // per-state slot of the captured errno, or NULL
+    caller_t *caller;  // per-state slot of the calling thread
+    dso_t *dso;        // dso to resolve the lazy symbol, NULL if closed
 };
 
+// native byte buffer created by dlopen.buffer
 typedef struct {
+    char *data;
+    size_t len; // number of bytes in use
+    size_t cap; // number of bytes allocated
+} buffer_t;
+
+// typed native array created by dlopen.array
+typedef struct {
+    datatype_t type;
+    size_t size;      // size of an element in bytes
+    size_t len;       // number of elements
+    callval_u data[]; // elements, aligned for any element type
+} array_t;
+
+// C function pointer bound to the Lua function, created by dlopen.callback
+typedef struct {
+    caller_t *caller; // slot of the thread to run the Lua function
+    int ref;          // reference to the Lua function
+    void *closure; // ffi_closure
+    void *code; // address of the C function
+    ffi_cif cif;
+    ffi_type *ret_ffi_type;
+    ffi_type *arg_ffi_types[FFI_MAX_ARGS]; // must remain valid for cif
+    // marshaling plan compiled from the signature by dlopen.callback
+    datatype_t ret_type;
+    structdef_t *ret_struct;
+    toarg_t toret; // converter of the return value
+    size_t nargs;
+    pushret_t pushargs[FFI_MAX_ARGS]; // pusher of each argument
+    structdef_t *arg_structs[FFI_MAX_ARGS];
+} callback_t;
+
+// block of the symbol names shared by the symbols of dlsym_many
+typedef struct nameblock_st {
+    struct nameblock_st *next;
+    char names[];
+} nameblock_t;
+
+// executable page that holds the jit thunks of a dso
+typedef struct jitpage_st {
+    struct jitpage_st *next;
+    uint8_t *code; // mapped page
+    size_t used;   // number of bytes in use
+} jitpage_t;
+
+struct dso_st {
     void *handle;
     char *path;
     syminfo_t *symbols_head;
     syminfo_t *symbols_tail;
-} dso_t;
+    nameblock_t *names; // freed with the symbols
+    jitpage_t *jit;     // pages of the jit thunks, freed with the symbols
+};
+
+// direct call stubs pass every integer and pointer argument as a 64-bit word.
+// this relies on the calling convention of the following LP64 targets, where
+// integer arguments and return values of any width share the same registers.
+#if !defined(_WIN32) && (defined(__x86_64__) || defined(__aarch64__)) &&      \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define DLOPEN_WORD_ARGS 1
+# ifndef DLOPEN_NO_DIRECT_CALL
+#  define DLOPEN_DIRECT_CALL 1
+# endif
+// machine code thunks are generated only if enabled by the DLOPEN_JIT build
+// option (see preprocess.lua)
+# if defined(DLOPEN_USE_JIT) && defined(__x86_64__)
+#  define DLOPEN_JIT 1
+# endif
+#endif
 
 #if SIZE_MAX == UINT32_MAX
 # define FFI_TYPE_SIZE_T  ffi_type_uint32
@@ -119,48 +330,59 @@ static inline const char *ffi_status_message(ffi_status st)
     }
 }
 
-static datatype_t check_ffitype(lua_State *L, int idx, ffi_type **ffi_type_out)
+static const char *const TYPE_NAMES[] = {
+    [T_VOID]       = "void",
+    [T_VOID_PTR]   = "void*",
+    [T_CHAR_PTR]   = "char*",
+    [T_CHAR]       = "char",
+    [T_SCHAR]      = "signed char",
+    [T_UCHAR]      = "unsigned char",
+    [T_SHORT]      = "short",
+    [T_USHORT]     = "unsigned short",
+    [T_INT8]       = "int8",
+    [T_UINT8]      = "uint8",
+    [T_INT16]      = "int16",
+    [T_UINT16]     = "uint16",
+    [T_INT]        = "int",
+    [T_UINT]       = "unsigned int",
+    [T_INT32]      = "int32",
+    [T_UINT32]     = "uint32",
+    [T_INT64]      = "int64",
+    [T_UINT64]     = "uint64",
+    [T_LONG]       = "long",
+    [T_ULONG]      = "unsigned long",
+    [T_LONG_LONG]  = "long long",
+    [T_ULONG_LONG] = "unsigned long long",
+    [T_FLOAT]      = "float",
+    [T_DOUBLE]     = "double",
+    [T_SIZE_T]     = "size_t",
+    [T_SSIZE_T]    = "ssize_t",
+    [T_BYTES]      = "bytes",
+    // output argument types have no name
+    [T_OUT]        = NULL,
+};
+
+// returns the datatype of the name of length len, or -1 if not found
+static int find_type(const char *name, size_t len)
 {
-    static const char *const type_names[] = {
-        [T_VOID]       = "void",
-        [T_VOID_PTR]   = "void*",
-        [T_CHAR_PTR]   = "char*",
-        [T_CHAR]       = "char",
-        [T_SCHAR]      = "signed char",
-        [T_UCHAR]      = "unsigned char",
-        [T_SHORT]      = "short",
-        [T_USHORT]     = "unsigned short",
-        [T_INT8]       = "int8",
-        [T_UINT8]      = "uint8",
-        [T_INT16]      = "int16",
-        [T_UINT16]     = "uint16",
-        [T_INT]        = "int",
-        [T_UINT]       = "unsigned int",
-        [T_INT32]      = "int32",
-        [T_UINT32]     = "uint32",
-        [T_INT64]      = "int64",
-        [T_UINT64]     = "uint64",
-        [T_LONG]       = "long",
-        [T_ULONG]      = "unsigned long",
-        [T_LONG_LONG]  = "long long",
-        [T_ULONG_LONG] = "unsigned long long",
-        [T_FLOAT]      = "float",
-        [T_DOUBLE]     = "double",
-        [T_SIZE_T]     = "size_t",
-        [T_SSIZE_T]    = "ssize_t",
-        NULL,
-    };
+    for (int t = 0; TYPE_NAMES[t]; t++) {
+        if (strncmp(TYPE_NAMES[t], name, len) == 0 && !TYPE_NAMES[t][len]) {
+            return t;
+        }
+    }
+    return -1;
+}
 
-    // luaL_checkoption will raise error for unknown option
-    switch ((datatype_t)luaL_checkoption(L, idx, NULL, type_names)) {
+// returns the ffi_type of the named datatype, or NULL if not found
+static ffi_type *datatype_ffi(datatype_t type)
+{
+    switch (type) {
     default:
-        // should never reach here: implementation bug (missing case)
-        luaL_error(L, "missing case for datatype");
+        return NULL;
 
 #define FFI_TYPE_CASE(TYPE_ENUM, FFI_TYPE_PTR)                                 \
     case TYPE_ENUM:                                                            \
-        *ffi_type_out = &FFI_TYPE_PTR;                                         \
-        return TYPE_ENUM
+        return &FFI_TYPE_PTR
 
         FFI_TYPE_CASE(T_VOID, ffi_type_void);
         FFI_TYPE_CASE(T_VOID_PTR, ffi_type_pointer);
@@ -188,436 +410,3728 @@ static datatype_t check_ffitype(lua_State *L, int idx, ffi_type **ffi_type_out)
         FFI_TYPE_CASE(T_DOUBLE, ffi_type_double);
         FFI_TYPE_CASE(T_SIZE_T, FFI_TYPE_SIZE_T);
         FFI_TYPE_CASE(T_SSIZE_T, FFI_TYPE_SSIZE_T);
+        // the length argument is added by dlsym_lua()
+        FFI_TYPE_CASE(T_BYTES, ffi_type_pointer);
 
 #undef FFI_TYPE_CASE
     }
 }
 
-typedef union {
-    void *p;
-    int8_t i8;
-    uint8_t u8;
-    int16_t i16;
-    uint16_t u16;
-    int32_t i32;
-    uint32_t u32;
-    int64_t i64;
-    uint64_t u64;
-    char c;
-    signed char sc;
-    unsigned char uc;
-    short s;
-    unsigned short us;
-    int i;
-    unsigned int ui;
-    long l;
-    unsigned long ul;
-    long long ll;
-    unsigned long long ull;
-    float f;
-    double d;
-    size_t sz;
-    ssize_t ssz;
-} callval_u;
-
-static int symcall_lua(lua_State *L)
+static datatype_t check_ffitype(lua_State *L, int idx, ffi_type **ffi_type_out)
 {
-    // exclude module userdata
-    int nargs            = lua_gettop(L) - 1;
-    syminfo_t *sym       = (syminfo_t *)lua_touserdata(L, lua_upvalueindex(1));
-    // prepare return value
-    callval_u retval     = {0};
-    void *RETVAL[T_LAST] = {
-        [T_VOID]       = NULL, // no return value for void
-        [T_VOID_PTR]   = &retval.p,
-        [T_CHAR_PTR]   = &retval.p,
-        [T_CHAR]       = &retval.c,
-        [T_SCHAR]      = &retval.sc,
-        [T_UCHAR]      = &retval.uc,
-        [T_SHORT]      = &retval.s,
-        [T_USHORT]     = &retval.us,
-        [T_INT8]       = &retval.i8,
-        [T_UINT8]      = &retval.u8,
-        [T_INT16]      = &retval.i16,
-        [T_UINT16]     = &retval.u16,
-        [T_INT]        = &retval.i,
-        [T_UINT]       = &retval.ui,
-        [T_INT32]      = &retval.i32,
-        [T_UINT32]     = &retval.u32,
-        [T_INT64]      = &retval.i64,
-        [T_UINT64]     = &retval.u64,
-        [T_LONG]       = &retval.l,
-        [T_ULONG]      = &retval.ul,
-        [T_LONG_LONG]  = &retval.ll,
-        [T_ULONG_LONG] = &retval.ull,
-        [T_FLOAT]      = &retval.f,
-        [T_DOUBLE]     = &retval.d,
-        [T_SIZE_T]     = &retval.sz,
-        [T_SSIZE_T]    = &retval.ssz,
-    };
-    void *ret_value                = RETVAL[sym->ret_type];
-    // prepare argument values
-    callval_u args[FFI_MAX_ARGS]   = {0};
-    void *arg_values[FFI_MAX_ARGS] = {NULL};
+    // luaL_checkoption will raise error for unknown option
+    datatype_t type = (datatype_t)luaL_checkoption(L, idx, NULL, TYPE_NAMES);
 
-    // check number of arguments
-    if (sym->nargs != (size_t)nargs) {
-        return luaL_error(L,
-                          "invalid number of arguments for symbol '%s': "
-                          "expected %d but got %d",
-                          sym->name, (int)sym->nargs, nargs);
+    if (!(*ffi_type_out = datatype_ffi(type))) {
+        // should never reach here: implementation bug (missing case)
+        luaL_error(L, "missing case for datatype");
     }
+    return type;
+}
+
+// check the argument type at idx. an output argument is specified by
+// appending '*' (output only) or '&' (input and output) to the name of the
+// value type, e.g. 'int*', 'size_t&' or 'void**'. base receives the value
+// type of the output argument.
+static datatype_t check_argtype(lua_State *L, int idx, ffi_type **ffi_type_out,
+                                datatype_t *base)
+{
+    size_t len       = 0;
+    const char *name = luaL_checklstring(L, idx, &len);
+    char suffix      = len ? name[len - 1] : 0;
+    int t            = 0;
 
-    // check return-value
-    if (!ret_value && sym->ret_type != T_VOID) {
-        return luaL_error(L, "unsupported return type for symbol '%s'",
-                          sym->name);
+    *base = T_VOID;
+    // 'void*' and 'char*' are the value types
+    if ((suffix == '*' || suffix == '&') && find_type(name, len) < 0 &&
+        (t = find_type(name, len - 1)) >= 0) {
+        *base         = (datatype_t)t;
+        *ffi_type_out = &ffi_type_pointer;
+        return (suffix == '*') ? T_OUT : T_INOUT;
     }
+    return check_ffitype(L, idx, ffi_type_out);
+}
 
-    // check arguments
-    for (int i = 0; i < nargs; i++) {
-        int index = 2 + i;
+// stores the integer value at idx to *v, and returns non-zero if the value
+// is an integer or a number with an exact integer representation
+static int tointeger(lua_State *L, int idx, lua_Integer *v)
+{
+#if LUA_VERSION_NUM >= 503
+    int isnum = 0;
 
-        switch (sym->arg_types[i]) {
-        default:
-            return luaL_error(L, "unsupported argument type for symbol '%s'",
-                              sym->name);
+    *v = lua_tointegerx(L, idx, &isnum);
+    return isnum;
+#else
+    lua_Number n = lua_tonumber(L, idx);
 
-        case T_VOID:
-            // GUARD: void should be rejected by dlsym_lua(), but this case
-            //        provides a safety net for implementation bugs
-            return luaL_error(L, "argument %d: void cannot be used as argument",
-                              i + 1);
-
-#define CHECK_RVAL2LVAL(LVAL, RVAL, LUA_CHECK_FUNC)                            \
-    RVAL = (typeof(RVAL))LUA_CHECK_FUNC(L, index);                             \
-    LVAL = (void *)&RVAL;
-
-        case T_VOID_PTR:
-            switch (lua_type(L, index)) {
-            case LUA_TNIL:
-            case LUA_TNONE:
-                args[i].p     = NULL;
-                arg_values[i] = &args[i].p;
-                break;
-            case LUA_TLIGHTUSERDATA:
-            case LUA_TUSERDATA:
-                CHECK_RVAL2LVAL(arg_values[i], args[i].p, lua_topointer);
-                break;
-            default:
-                return luaL_error(
-                    L,
-                    "argument %d: void* requires nil, lightuserdata "
-                    "or userdata, got %s",
-                    i + 1, lua_typename(L, lua_type(L, index)));
-            }
-            break;
+    *v = (lua_Integer)n;
+    return lua_isnumber(L, idx) && (lua_Number)*v == n;
+#endif
+}
 
-        case T_CHAR_PTR:
-            switch (lua_type(L, index)) {
-            case LUA_TNIL:
-            case LUA_TNONE:
-                args[i].p     = NULL;
-                arg_values[i] = &args[i].p;
-                break;
-            case LUA_TSTRING:
-                CHECK_RVAL2LVAL(arg_values[i], args[i].p, lua_tostring);
-                break;
-            default:
-                return luaL_error(
-                    L, "argument %d: char* requires nil or string, got %s",
-                    i + 1, lua_typename(L, lua_type(L, index)));
-            }
-            break;
+// returns the memory block of the buffer or the array, or the address of the
+// callback at idx, or NULL if the value is none of them. len receives the
+// size of the memory in bytes.
+static void *tomemory(lua_State *L, int idx, size_t *len)
+{
+    void *ud  = lua_touserdata(L, idx);
+    void *mem = NULL;
 
-#define CHECK_CASE(TYPE_ENUM, FIELD, LUA_CHECK_FUNC)                           \
-    case TYPE_ENUM:                                                            \
-        CHECK_RVAL2LVAL(arg_values[i], args[i].FIELD, LUA_CHECK_FUNC);         \
-        break
-
-            CHECK_CASE(T_CHAR, c, luaL_checkinteger);
-            CHECK_CASE(T_SCHAR, sc, luaL_checkinteger);
-            CHECK_CASE(T_UCHAR, uc, luaL_checkinteger);
-            CHECK_CASE(T_SHORT, s, luaL_checkinteger);
-            CHECK_CASE(T_USHORT, us, luaL_checkinteger);
-            CHECK_CASE(T_INT8, i8, luaL_checkinteger);
-            CHECK_CASE(T_UINT8, u8, luaL_checkinteger);
-            CHECK_CASE(T_INT16, i16, luaL_checkinteger);
-            CHECK_CASE(T_UINT16, u16, luaL_checkinteger);
-            CHECK_CASE(T_INT, i, luaL_checkinteger);
-            CHECK_CASE(T_UINT, ui, luaL_checkinteger);
-            CHECK_CASE(T_INT32, i32, luaL_checkinteger);
-            CHECK_CASE(T_UINT32, u32, luaL_checkinteger);
-            CHECK_CASE(T_INT64, i64, luaL_checkinteger);
-            CHECK_CASE(T_UINT64, u64, luaL_checkinteger);
-            CHECK_CASE(T_LONG, l, luaL_checkinteger);
-            CHECK_CASE(T_ULONG, ul, luaL_checkinteger);
-            CHECK_CASE(T_LONG_LONG, ll, luaL_checkinteger);
-            CHECK_CASE(T_ULONG_LONG, ull, luaL_checkinteger);
-            CHECK_CASE(T_FLOAT, f, luaL_checknumber);
-            CHECK_CASE(T_DOUBLE, d, luaL_checknumber);
-            CHECK_CASE(T_SIZE_T, sz, luaL_checkinteger);
-            CHECK_CASE(T_SSIZE_T, ssz, luaL_checkinteger);
-
-#undef CHECK_CASE
-#undef CHECK_RVAL2LVAL
+    if (ud && lua_getmetatable(L, idx)) {
+        luaL_getmetatable(L, BUFFER_MT);
+        if (lua_rawequal(L, -1, -2)) {
+            mem  = ((buffer_t *)ud)->data;
+            *len = ((buffer_t *)ud)->len;
+        } else {
+            lua_pop(L, 1);
+            luaL_getmetatable(L, ARRAY_MT);
+            if (lua_rawequal(L, -1, -2)) {
+                mem  = ((array_t *)ud)->data;
+                *len = ((array_t *)ud)->len * ((array_t *)ud)->size;
+            } else {
+                lua_pop(L, 1);
+                luaL_getmetatable(L, CALLBACK_MT);
+                if (lua_rawequal(L, -1, -2)) {
+                    mem  = ((callback_t *)ud)->code;
+                    *len = 0;
+                }
+            }
         }
+        lua_pop(L, 2);
     }
+    return mem;
+}
 
-    // call symbol function
-    ffi_call(&sym->cif, FFI_FN(sym->addr), ret_value, arg_values);
+static void toarg_void_ptr(lua_State *L, int idx, int argn, callval_u *val)
+{
+    size_t len = 0;
 
-    // push return value
-    switch (sym->ret_type) {
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+    case LUA_TNONE:
+        val->p = NULL;
+        return;
+    case LUA_TLIGHTUSERDATA:
+        val->p = lua_touserdata(L, idx);
+        return;
+    case LUA_TUSERDATA:
+        // buffer and array pass their memory block
+        if (!(val->p = tomemory(L, idx, &len))) {
+            val->p = lua_touserdata(L, idx);
+        }
+        return;
     default:
-        return luaL_error(L, "unsupported return type for symbol '%s'",
-                          sym->name);
-
-    case T_VOID:
-        return 0;
-
-    case T_VOID_PTR:
-        (retval.p) ? lua_pushlightuserdata(L, retval.p) : lua_pushnil(L);
-        return 1;
-
-    case T_CHAR_PTR:
-        (retval.p) ? lua_pushstring(L, retval.p) : lua_pushnil(L);
-        return 1;
-
-#define PUSH_CASE(TYPE_ENUM, PUSHFN, FIELD)                                    \
-    case TYPE_ENUM:                                                            \
-        PUSHFN(L, retval.FIELD);                                               \
-        return 1
-
-        PUSH_CASE(T_CHAR, lua_pushinteger, c);
-        PUSH_CASE(T_SCHAR, lua_pushinteger, sc);
-        PUSH_CASE(T_UCHAR, lua_pushinteger, uc);
-        PUSH_CASE(T_SHORT, lua_pushinteger, s);
-        PUSH_CASE(T_USHORT, lua_pushinteger, us);
-        PUSH_CASE(T_INT8, lua_pushinteger, i8);
-        PUSH_CASE(T_UINT8, lua_pushinteger, u8);
-        PUSH_CASE(T_INT16, lua_pushinteger, i16);
-        PUSH_CASE(T_UINT16, lua_pushinteger, u16);
-        PUSH_CASE(T_INT, lua_pushinteger, i);
-        PUSH_CASE(T_UINT, lua_pushinteger, ui);
-        PUSH_CASE(T_INT32, lua_pushinteger, i32);
-        PUSH_CASE(T_UINT32, lua_pushinteger, u32);
-        PUSH_CASE(T_INT64, lua_pushinteger, i64);
-        PUSH_CASE(T_UINT64, lua_pushinteger, u64);
-        PUSH_CASE(T_LONG, lua_pushinteger, l);
-        PUSH_CASE(T_ULONG, lua_pushinteger, ul);
-        PUSH_CASE(T_LONG_LONG, lua_pushinteger, ll);
-        PUSH_CASE(T_ULONG_LONG, lua_pushinteger, ull);
-        PUSH_CASE(T_FLOAT, lua_pushnumber, f);
-        PUSH_CASE(T_DOUBLE, lua_pushnumber, d);
-        PUSH_CASE(T_SIZE_T, lua_pushinteger, sz);
-        PUSH_CASE(T_SSIZE_T, lua_pushinteger, ssz);
-
-#undef PUSH_CASE
+        luaL_error(L,
+                   "argument %d: void* requires nil, lightuserdata or "
+                   "userdata, got %s",
+                   argn, lua_typename(L, lua_type(L, idx)));
     }
 }
 
-static int dlsym_lua(lua_State *L)
+static void toarg_char_ptr(lua_State *L, int idx, int argn, callval_u *val)
 {
-    int nargs         = lua_gettop(L) - 1;
-    dso_t *dso        = (dso_t *)luaL_checkudata(L, 1, MODULE_MT);
-    size_t len        = 0;
-    const char *name  = NULL;
-    syminfo_t *sym    = lua_newuserdata(L, sizeof(syminfo_t));
-    ffi_status status = FFI_OK;
-
-    // number of arguments must be FFI_MAX_ARGS + 2
-    // +2 for including return-type and function-name
-    if (nargs < 2 || nargs > FFI_MAX_ARGS + 2) {
-        lua_pushboolean(L, 0);
-        lua_pushfstring(L, "number of arguments at least 2 and at most %d",
-                        FFI_MAX_ARGS + 2);
-        return 2;
-    }
+    size_t len = 0;
 
-    // check return-type
-    sym->ret_type = check_ffitype(L, 2, &sym->ret_ffi_type);
-    // check function-name
-    name          = luaL_checklstring(L, 3, &len);
-    // check arguments
-    sym->nargs    = nargs - 2; // exclude return type and function name
-    for (size_t i = 0; i < sym->nargs; i++) {
-        sym->arg_types[i] = check_ffitype(L, 4 + i, &sym->arg_ffi_types[i]);
-        if (sym->arg_types[i] == T_VOID) {
-            lua_pushboolean(L, 0);
-            lua_pushfstring(L, "void cannot be used as argument type");
-            return 2;
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+    case LUA_TNONE:
+        val->p = NULL;
+        return;
+    case LUA_TSTRING:
+        val->p = (void *)lua_tostring(L, idx);
+        return;
+    case LUA_TUSERDATA:
+        // buffer is writable memory for the output string
+        if ((val->p = tomemory(L, idx, &len))) {
+            return;
         }
+        // fallthrough
+    default:
+        luaL_error(L,
+                   "argument %d: char* requires nil, string or buffer, got %s",
+                   argn, lua_typename(L, lua_type(L, idx)));
     }
+}
 
-    // copy symbol name
-    sym->len = len;
-    if (!(sym->name = strdup(name))) {
-        lua_pushboolean(L, 0);
-        lua_pushfstring(L, "failed to allocate memory for symbol name");
-        return 2;
-    }
+// bytes is converted to the pointer and the length, val[1] is the length
+static void toarg_bytes(lua_State *L, int idx, int argn, callval_u *val)
+{
+    size_t len = 0;
 
-    // find symbol address
-    if (!(sym->addr = dlsym(dso->handle, name))) {
-        free(sym->name);
-        lua_pushboolean(L, 0);
-        lua_pushfstring(L, "failed to find symbol '%s': %s", name, dlerror());
-        return 2;
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+    case LUA_TNONE:
+        val[0].p = NULL;
+        break;
+    case LUA_TSTRING:
+        val[0].p = (void *)lua_tolstring(L, idx, &len);
+        break;
+    case LUA_TUSERDATA:
+        if (!(val[0].p = tomemory(L, idx, &len))) {
+            val[0].p = lua_touserdata(L, idx);
+            len      = lua_rawlen(L, idx);
+        }
+        break;
+    default:
+        luaL_error(L,
+                   "argument %d: bytes requires nil, string or userdata, "
+                   "got %s",
+                   argn, lua_typename(L, lua_type(L, idx)));
     }
+    val[1].sz = len;
+}
 
-    // prepare FFI call interface
-    status = ffi_prep_cif(&sym->cif, FFI_DEFAULT_ABI, sym->nargs,
-                          sym->ret_ffi_type, sym->arg_ffi_types);
-    if (status != FFI_OK) {
-        free(sym->name);
-        lua_pushboolean(L, 0);
-        lua_pushfstring(
-            L, "failed to prepare FFI call interface for symbol '%s' (%s)",
-            name, ffi_status_message(status));
-        return 2;
+#define TOARG_FUNC(NAME, FIELD, LUA_CHECK_FUNC)                                \
+    static void toarg_##NAME(lua_State *L, int idx, int argn, callval_u *val)  \
+    {                                                                          \
+        (void)argn;                                                            \
+        val->FIELD = (typeof(val->FIELD))LUA_CHECK_FUNC(L, idx);               \
     }
 
-    // keep reference to syminfo
-    sym->ref  = luaL_ref(L, LUA_REGISTRYINDEX);
-    // append to symbol list
-    sym->next = NULL;
-    if (!dso->symbols_head) {
-        dso->symbols_head = sym;
-        dso->symbols_tail = sym;
-    } else {
-        dso->symbols_tail->next = sym;
-        dso->symbols_tail       = sym;
-    }
-    lua_pushboolean(L, 1);
-    return 1;
-}
+#ifdef DLOPEN_WORD_ARGS
+// integer values are stored as a sign or zero extended 64-bit word, so that
+// the direct call stubs and the jit thunks can pass them as is. on
+// little-endian targets the narrower member still reads back the same value
+// for ffi_call.
+# define TOARG_INTEGER_FUNC(NAME, FIELD, LUA_TO_FUNC)                          \
+     static void toarg_##NAME(lua_State *L, int idx, int argn,                 \
+                              callval_u *val)                                  \
+     {                                                                         \
+         (void)argn;                                                           \
+         val->u64 = (uint64_t)(typeof(val->FIELD))LUA_TO_FUNC(L, idx);         \
+     }
+#else
+# define TOARG_INTEGER_FUNC(NAME, FIELD, LUA_TO_FUNC)                          \
+     TOARG_FUNC(NAME, FIELD, LUA_TO_FUNC)
+#endif
 
-static int dso_close(lua_State *L, dso_t *dso)
-{
-    void *handle   = dso->handle;
-    syminfo_t *sym = dso->symbols_head;
+TOARG_INTEGER_FUNC(char, c, luaL_checkinteger)
+TOARG_INTEGER_FUNC(schar, sc, luaL_checkinteger)
+TOARG_INTEGER_FUNC(uchar, uc, luaL_checkinteger)
+TOARG_INTEGER_FUNC(short, s, luaL_checkinteger)
+TOARG_INTEGER_FUNC(ushort, us, luaL_checkinteger)
+TOARG_INTEGER_FUNC(int8, i8, luaL_checkinteger)
+TOARG_INTEGER_FUNC(uint8, u8, luaL_checkinteger)
+TOARG_INTEGER_FUNC(int16, i16, luaL_checkinteger)
+TOARG_INTEGER_FUNC(uint16, u16, luaL_checkinteger)
+TOARG_INTEGER_FUNC(int, i, luaL_checkinteger)
+TOARG_INTEGER_FUNC(uint, ui, luaL_checkinteger)
+TOARG_INTEGER_FUNC(int32, i32, luaL_checkinteger)
+TOARG_INTEGER_FUNC(uint32, u32, luaL_checkinteger)
+TOARG_INTEGER_FUNC(int64, i64, luaL_checkinteger)
+TOARG_INTEGER_FUNC(uint64, u64, luaL_checkinteger)
+TOARG_INTEGER_FUNC(long, l, luaL_checkinteger)
+TOARG_INTEGER_FUNC(ulong, ul, luaL_checkinteger)
+TOARG_INTEGER_FUNC(long_long, ll, luaL_checkinteger)
+TOARG_INTEGER_FUNC(ulong_long, ull, luaL_checkinteger)
+TOARG_FUNC(float, f, luaL_checknumber)
+TOARG_FUNC(double, d, luaL_checknumber)
+TOARG_INTEGER_FUNC(size_t, sz, luaL_checkinteger)
+TOARG_INTEGER_FUNC(ssize_t, ssz, luaL_checkinteger)
 
-    if (handle) {
-        // free path
-        free(dso->path);
-        dso->path = NULL;
 
-        // free symbol entry
-        while (sym) {
-            syminfo_t *next = sym->next;
-            free(sym->name);
-            luaL_unref(L, LUA_REGISTRYINDEX, sym->ref);
-            sym->ref  = LUA_NOREF;
-            sym->next = NULL;
-            sym       = next;
-        }
+// converters of the unchecked mode use the raw accessors without validating
+// the type of the Lua values. the wrong input produces undefined results.
+// a buffer and an array are still resolved to their memory block since the
+// address of the userdata is not the address of the memory.
+static void toarg_void_ptr_unchecked(lua_State *L, int idx, int argn,
+                                     callval_u *val)
+{
+    size_t len = 0;
 
-        // close module
-        dso->handle = NULL;
-        return dlclose(handle);
+    (void)argn;
+    if (lua_type(L, idx) == LUA_TUSERDATA &&
+        (val->p = tomemory(L, idx, &len))) {
+        return;
     }
-    return 0;
+    val->p = lua_touserdata(L, idx);
 }
 
-static int dlclose_lua(lua_State *L)
+static void toarg_char_ptr_unchecked(lua_State *L, int idx, int argn,
+                                     callval_u *val)
 {
-    dso_t *dso = (dso_t *)luaL_checkudata(L, 1, MODULE_MT);
+    size_t len = 0;
 
-    if (dso_close(L, dso) == 0) {
-        lua_pushboolean(L, 1);
-        return 1;
+    (void)argn;
+    if (lua_type(L, idx) == LUA_TUSERDATA &&
+        (val->p = tomemory(L, idx, &len))) {
+        return;
     }
-    // dlclose failed
-    lua_pushboolean(L, 0);
-    lua_pushfstring(L, "failed to close module: %s", dlerror());
-    return 2;
+    val->p = (void *)lua_tostring(L, idx);
 }
 
-static int index_lua(lua_State *L)
+static void toarg_bytes_unchecked(lua_State *L, int idx, int argn,
+                                  callval_u *val)
 {
-    dso_t *dso         = (dso_t *)luaL_checkudata(L, 1, MODULE_MT);
-    size_t len         = 0;
-    const char *method = luaL_checklstring(L, 2, &len);
+    size_t len = 0;
 
-    // check if module is closed
-    if (!dso->handle) {
-        return luaL_error(L, "module is closed");
+    (void)argn;
+    if (lua_type(L, idx) != LUA_TUSERDATA ||
+        !(val[0].p = tomemory(L, idx, &len))) {
+        val[0].p = (void *)lua_tolstring(L, idx, &len);
     }
+    val[1].sz = len;
+}
 
-    // dispatch method
-    if (strncmp(method, "dlsym", len) == 0) {
-        lua_pushcfunction(L, dlsym_lua);
-        return 1;
-    } else if (strncmp(method, "dlclose", len) == 0) {
-        lua_pushcfunction(L, dlclose_lua);
-        return 1;
-    }
+TOARG_INTEGER_FUNC(char_unchecked, c, lua_tointeger)
+TOARG_INTEGER_FUNC(schar_unchecked, sc, lua_tointeger)
+TOARG_INTEGER_FUNC(uchar_unchecked, uc, lua_tointeger)
+TOARG_INTEGER_FUNC(short_unchecked, s, lua_tointeger)
+TOARG_INTEGER_FUNC(ushort_unchecked, us, lua_tointeger)
+TOARG_INTEGER_FUNC(int8_unchecked, i8, lua_tointeger)
+TOARG_INTEGER_FUNC(uint8_unchecked, u8, lua_tointeger)
+TOARG_INTEGER_FUNC(int16_unchecked, i16, lua_tointeger)
+TOARG_INTEGER_FUNC(uint16_unchecked, u16, lua_tointeger)
+TOARG_INTEGER_FUNC(int_unchecked, i, lua_tointeger)
+TOARG_INTEGER_FUNC(uint_unchecked, ui, lua_tointeger)
+TOARG_INTEGER_FUNC(int32_unchecked, i32, lua_tointeger)
+TOARG_INTEGER_FUNC(uint32_unchecked, u32, lua_tointeger)
+TOARG_INTEGER_FUNC(int64_unchecked, i64, lua_tointeger)
+TOARG_INTEGER_FUNC(uint64_unchecked, u64, lua_tointeger)
+TOARG_INTEGER_FUNC(long_unchecked, l, lua_tointeger)
+TOARG_INTEGER_FUNC(ulong_unchecked, ul, lua_tointeger)
+TOARG_INTEGER_FUNC(long_long_unchecked, ll, lua_tointeger)
+TOARG_INTEGER_FUNC(ulong_long_unchecked, ull, lua_tointeger)
+TOARG_FUNC(float_unchecked, f, lua_tonumber)
+TOARG_FUNC(double_unchecked, d, lua_tonumber)
+TOARG_INTEGER_FUNC(size_t_unchecked, sz, lua_tointeger)
+TOARG_INTEGER_FUNC(ssize_t_unchecked, ssz, lua_tointeger)
 
-    // traverse symbols
-    for (syminfo_t *sym = dso->symbols_head; sym; sym = sym->next) {
-        if (len == sym->len && strncmp(method, sym->name, len) == 0) {
-            // found symbol
-            lua_rawgeti(L, LUA_REGISTRYINDEX, sym->ref);
-            lua_pushcclosure(L, symcall_lua, 1);
-            return 1;
-        }
-    }
+#undef TOARG_INTEGER_FUNC
+#undef TOARG_FUNC
 
-    // unknown method
-    return luaL_error(L, "attempt to index invalid unknown field '%s'",
-                      lua_tostring(L, 2));
-}
+static const toarg_t TOARGS[T_LAST] = {
+    // void cannot be used as argument, it is rejected by dlsym_lua()
+    [T_VOID]       = NULL,
+    [T_VOID_PTR]   = toarg_void_ptr,
+    [T_CHAR_PTR]   = toarg_char_ptr,
+    [T_CHAR]       = toarg_char,
+    [T_SCHAR]      = toarg_schar,
+    [T_UCHAR]      = toarg_uchar,
+    [T_SHORT]      = toarg_short,
+    [T_USHORT]     = toarg_ushort,
+    [T_INT8]       = toarg_int8,
+    [T_UINT8]      = toarg_uint8,
+    [T_INT16]      = toarg_int16,
+    [T_UINT16]     = toarg_uint16,
+    [T_INT]        = toarg_int,
+    [T_UINT]       = toarg_uint,
+    [T_INT32]      = toarg_int32,
+    [T_UINT32]     = toarg_uint32,
+    [T_INT64]      = toarg_int64,
+    [T_UINT64]     = toarg_uint64,
+    [T_LONG]       = toarg_long,
+    [T_ULONG]      = toarg_ulong,
+    [T_LONG_LONG]  = toarg_long_long,
+    [T_ULONG_LONG] = toarg_ulong_long,
+    [T_FLOAT]      = toarg_float,
+    [T_DOUBLE]     = toarg_double,
+    [T_SIZE_T]     = toarg_size_t,
+    [T_SSIZE_T]    = toarg_ssize_t,
+    // output arguments are not passed from Lua
+    [T_BYTES]      = toarg_bytes,
+    [T_OUT]        = NULL,
+    [T_INOUT]      = NULL,
+    [T_STRUCT]     = NULL,
+};
 
-static int gc_lua(lua_State *L)
+static const toarg_t UNCHECKED_TOARGS[T_LAST] = {
+    [T_VOID]       = NULL,
+    [T_VOID_PTR]   = toarg_void_ptr_unchecked,
+    [T_CHAR_PTR]   = toarg_char_ptr_unchecked,
+    [T_CHAR]       = toarg_char_unchecked,
+    [T_SCHAR]      = toarg_schar_unchecked,
+    [T_UCHAR]      = toarg_uchar_unchecked,
+    [T_SHORT]      = toarg_short_unchecked,
+    [T_USHORT]     = toarg_ushort_unchecked,
+    [T_INT8]       = toarg_int8_unchecked,
+    [T_UINT8]      = toarg_uint8_unchecked,
+    [T_INT16]      = toarg_int16_unchecked,
+    [T_UINT16]     = toarg_uint16_unchecked,
+    [T_INT]        = toarg_int_unchecked,
+    [T_UINT]       = toarg_uint_unchecked,
+    [T_INT32]      = toarg_int32_unchecked,
+    [T_UINT32]     = toarg_uint32_unchecked,
+    [T_INT64]      = toarg_int64_unchecked,
+    [T_UINT64]     = toarg_uint64_unchecked,
+    [T_LONG]       = toarg_long_unchecked,
+    [T_ULONG]      = toarg_ulong_unchecked,
+    [T_LONG_LONG]  = toarg_long_long_unchecked,
+    [T_ULONG_LONG] = toarg_ulong_long_unchecked,
+    [T_FLOAT]      = toarg_float_unchecked,
+    [T_DOUBLE]     = toarg_double_unchecked,
+    [T_SIZE_T]     = toarg_size_t_unchecked,
+    [T_SSIZE_T]    = toarg_ssize_t_unchecked,
+    [T_BYTES]      = toarg_bytes_unchecked,
+    [T_OUT]        = NULL,
+    [T_INOUT]      = NULL,
+    [T_STRUCT]     = NULL,
+};
+
+static int pushret_void(lua_State *L, callval_u *val)
 {
-    dso_t *dso = (dso_t *)luaL_checkudata(L, 1, MODULE_MT);
-    dso_close(L, dso);
+    (void)L;
+    (void)val;
     return 0;
 }
 
-static int tostring_lua(lua_State *L)
+static int pushret_void_ptr(lua_State *L, callval_u *val)
 {
-    dso_t *dso = (dso_t *)lua_touserdata(L, 1);
-    lua_pushfstring(L, "%s: %p (%s)", MODULE_MT, dso->handle, dso->path);
+    (val->p) ? lua_pushlightuserdata(L, val->p) : lua_pushnil(L);
     return 1;
 }
 
-static int new_lua(lua_State *L)
+static int pushret_char_ptr(lua_State *L, callval_u *val)
 {
-    size_t len       = 0;
-    const char *path = luaL_checklstring(L, 1, &len);
-    dso_t *dso       = NULL;
+    (val->p) ? lua_pushstring(L, val->p) : lua_pushnil(L);
+    return 1;
+}
 
-    // clear stack except path
-    lua_settop(L, 1);
+#define PUSHRET_FUNC(NAME, PUSHFN, FIELD)                                      \
+    static int pushret_##NAME(lua_State *L, callval_u *val)                    \
+    {                                                                          \
+        PUSHFN(L, val->FIELD);                                                 \
+        return 1;                                                              \
+    }
+
+PUSHRET_FUNC(char, lua_pushinteger, c)
+PUSHRET_FUNC(schar, lua_pushinteger, sc)
+PUSHRET_FUNC(uchar, lua_pushinteger, uc)
+PUSHRET_FUNC(short, lua_pushinteger, s)
+PUSHRET_FUNC(ushort, lua_pushinteger, us)
+PUSHRET_FUNC(int8, lua_pushinteger, i8)
+PUSHRET_FUNC(uint8, lua_pushinteger, u8)
+PUSHRET_FUNC(int16, lua_pushinteger, i16)
+PUSHRET_FUNC(uint16, lua_pushinteger, u16)
+PUSHRET_FUNC(int, lua_pushinteger, i)
+PUSHRET_FUNC(uint, lua_pushinteger, ui)
+PUSHRET_FUNC(int32, lua_pushinteger, i32)
+PUSHRET_FUNC(uint32, lua_pushinteger, u32)
+PUSHRET_FUNC(int64, lua_pushinteger, i64)
+PUSHRET_FUNC(uint64, lua_pushinteger, u64)
+PUSHRET_FUNC(long, lua_pushinteger, l)
+PUSHRET_FUNC(ulong, lua_pushinteger, ul)
+PUSHRET_FUNC(long_long, lua_pushinteger, ll)
+PUSHRET_FUNC(ulong_long, lua_pushinteger, ull)
+PUSHRET_FUNC(float, lua_pushnumber, f)
+PUSHRET_FUNC(double, lua_pushnumber, d)
+PUSHRET_FUNC(size_t, lua_pushinteger, sz)
+PUSHRET_FUNC(ssize_t, lua_pushinteger, ssz)
+
+#undef PUSHRET_FUNC
+
+static const pushret_t PUSHRETS[T_LAST] = {
+    [T_VOID]       = pushret_void,
+    [T_VOID_PTR]   = pushret_void_ptr,
+    [T_CHAR_PTR]   = pushret_char_ptr,
+    [T_CHAR]       = pushret_char,
+    [T_SCHAR]      = pushret_schar,
+    [T_UCHAR]      = pushret_uchar,
+    [T_SHORT]      = pushret_short,
+    [T_USHORT]     = pushret_ushort,
+    [T_INT8]       = pushret_int8,
+    [T_UINT8]      = pushret_uint8,
+    [T_INT16]      = pushret_int16,
+    [T_UINT16]     = pushret_uint16,
+    [T_INT]        = pushret_int,
+    [T_UINT]       = pushret_uint,
+    [T_INT32]      = pushret_int32,
+    [T_UINT32]     = pushret_uint32,
+    [T_INT64]      = pushret_int64,
+    [T_UINT64]     = pushret_uint64,
+    [T_LONG]       = pushret_long,
+    [T_ULONG]      = pushret_ulong,
+    [T_LONG_LONG]  = pushret_long_long,
+    [T_ULONG_LONG] = pushret_ulong_long,
+    [T_FLOAT]      = pushret_float,
+    [T_DOUBLE]     = pushret_double,
+    [T_SIZE_T]     = pushret_size_t,
+    [T_SSIZE_T]    = pushret_ssize_t,
+    // argument only types cannot be used as return type
+    [T_BYTES]      = NULL,
+    [T_OUT]        = NULL,
+    [T_INOUT]      = NULL,
+    [T_STRUCT]     = NULL,
+};
+
+#ifdef DLOPEN_DIRECT_CALL
+
+// maximum number of arguments of the direct call stubs
+# define STUB_MAX_ARGS 4
+
+// argument and return value classes of the direct call stubs
+//  V: void (return value only)
+//  W: integer or pointer passed as a 64-bit word
+//  D: double
+typedef enum {
+    STUB_V,
+    STUB_W,
+    STUB_D,
+    STUB_NONE,
+} stubclass_t;
+
+# define STUB_TYPE_V      void
+# define STUB_TYPE_W      uint64_t
+# define STUB_TYPE_D      double
+# define STUB_ARG_W(i)    args[i].u64
+# define STUB_ARG_D(i)    args[i].d
+# define STUB_RET_V(call) call
+# define STUB_RET_W(call) retval->u64 = call
+# define STUB_RET_D(call) retval->d = call
+# define STUB_FN(R, ...)  ((STUB_TYPE_##R(*)(__VA_ARGS__))fn)
+
+# define DEFSTUB0(R)                                                           \
+     static void stub_##R##_(void *fn, callval_u *retval, callval_u *args)     \
+     {                                                                         \
+         (void)retval;                                                         \
+         (void)args;                                                           \
+         STUB_RET_##R(STUB_FN(R, void)());                                     \
+     }
+# define DEFSTUB1(R, A0)                                                       \
+     static void stub_##R##_##A0(void *fn, callval_u *retval, callval_u *args) \
+     {                                                                         \
+         (void)retval;                                                         \
+         STUB_RET_##R(STUB_FN(R, STUB_TYPE_##A0)(STUB_ARG_##A0(0)));           \
+     }
+# define DEFSTUB2(R, A0, A1)                                                   \
+     static void stub_##R##_##A0##A1(void *fn, callval_u *retval,              \
+                                     callval_u *args)                          \
+     {                                                                         \
+         (void)retval;                                                         \
+         STUB_RET_##R(STUB_FN(R, STUB_TYPE_##A0, STUB_TYPE_##A1)(              \
+             STUB_ARG_##A0(0), STUB_ARG_##A1(1)));                             \
+     }
+# define DEFSTUB3(R, A0, A1, A2)                                               \
+     static void stub_##R##_##A0##A1##A2(void *fn, callval_u *retval,         \
+                                         callval_u *args)                      \
+     {                                                                         \
+         (void)retval;                                                         \
+         STUB_RET_##R(                                                         \
+             STUB_FN(R, STUB_TYPE_##A0, STUB_TYPE_##A1, STUB_TYPE_##A2)(       \
+                 STUB_ARG_##A0(0), STUB_ARG_##A1(1), STUB_ARG_##A2(2)));       \
+     }
+# define DEFSTUB4(R, A0, A1, A2, A3)                                           \
+     static void stub_##R##_##A0##A1##A2##A3(void *fn, callval_u *retval,     \
+                                             callval_u *args)                  \
+     {                                                                         \
+         (void)retval;                                                         \
+         STUB_RET_##R(STUB_FN(R, STUB_TYPE_##A0, STUB_TYPE_##A1,               \
+                              STUB_TYPE_##A2, STUB_TYPE_##A3)(                 \
+             STUB_ARG_##A0(0), STUB_ARG_##A1(1), STUB_ARG_##A2(2),             \
+             STUB_ARG_##A3(3)));                                               \
+     }
+
+# define STUB_ENTRY0(R)                 stub_##R##_,
+# define STUB_ENTRY1(R, A0)             stub_##R##_##A0,
+# define STUB_ENTRY2(R, A0, A1)         stub_##R##_##A0##A1,
+# define STUB_ENTRY3(R, A0, A1, A2)     stub_##R##_##A0##A1##A2,
+# define STUB_ENTRY4(R, A0, A1, A2, A3) stub_##R##_##A0##A1##A2##A3,
+
+// expand M for every combination of the argument classes W and D.
+// the first argument is the most significant bit, W is 0 and D is 1.
+# define STUB_EACH1(M, ...) M(__VA_ARGS__, W) M(__VA_ARGS__, D)
+# define STUB_EACH2(M, ...)                                                    \
+     STUB_EACH1(M, __VA_ARGS__, W) STUB_EACH1(M, __VA_ARGS__, D)
+# define STUB_EACH3(M, ...)                                                    \
+     STUB_EACH2(M, __VA_ARGS__, W) STUB_EACH2(M, __VA_ARGS__, D)
+# define STUB_EACH4(M, ...)                                                    \
+     STUB_EACH3(M, __VA_ARGS__, W) STUB_EACH3(M, __VA_ARGS__, D)
+
+# define STUB_EACH(PREFIX, R)                                                  \
+     PREFIX##0(R) STUB_EACH1(PREFIX##1, R) STUB_EACH2(PREFIX##2, R)            \
+         STUB_EACH3(PREFIX##3, R) STUB_EACH4(PREFIX##4, R)
+
+STUB_EACH(DEFSTUB, V)
+STUB_EACH(DEFSTUB, W)
+STUB_EACH(DEFSTUB, D)
+
+// stubs of the arity n are placed at (1 << n) - 1 + argument class bits
+static const symstub_t SYMSTUBS[][(1 << (STUB_MAX_ARGS + 1)) - 1] = {
+    [STUB_V] = {STUB_EACH(STUB_ENTRY, V)},
+    [STUB_W] = {STUB_EACH(STUB_ENTRY, W)},
+    [STUB_D] = {STUB_EACH(STUB_ENTRY, D)},
+};
+
+# undef STUB_EACH
+# undef STUB_EACH4
+# undef STUB_EACH3
+# undef STUB_EACH2
+# undef STUB_EACH1
+# undef STUB_ENTRY4
+# undef STUB_ENTRY3
+# undef STUB_ENTRY2
+# undef STUB_ENTRY1
+# undef STUB_ENTRY0
+# undef DEFSTUB4
+# undef DEFSTUB3
+# undef DEFSTUB2
+# undef DEFSTUB1
+# undef DEFSTUB0
+# undef STUB_FN
+# undef STUB_RET_D
+# undef STUB_RET_W
+# undef STUB_RET_V
+# undef STUB_ARG_D
+# undef STUB_ARG_W
+# undef STUB_TYPE_D
+# undef STUB_TYPE_W
+# undef STUB_TYPE_V
+
+static inline stubclass_t get_stubclass(datatype_t type)
+{
+    switch (type) {
+    case T_VOID:
+        return STUB_V;
+    case T_FLOAT:
+        // float is passed in a different form than double
+        return STUB_NONE;
+    case T_DOUBLE:
+        return STUB_D;
+    default:
+        return STUB_W;
+    }
+}
+
+static symstub_t select_stub(syminfo_t *sym)
+{
+    stubclass_t ret = get_stubclass(sym->sig->ret_type);
+    size_t bits     = 0;
+
+    if (ret == STUB_NONE || sym->sig->nargs > STUB_MAX_ARGS) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sym->sig->nargs; i++) {
+        switch (get_stubclass(sym->sig->arg_types[i])) {
+        case STUB_W:
+            bits = bits << 1;
+            break;
+        case STUB_D:
+            bits = (bits << 1) | 1;
+            break;
+        default:
+            return NULL;
+        }
+    }
+    return SYMSTUBS[ret][((size_t)1 << sym->sig->nargs) - 1 + bits];
+}
+
+#else
+
+static symstub_t select_stub(syminfo_t *sym)
+{
+    (void)sym;
+    return NULL;
+}
+
+#endif
+
+#ifdef DLOPEN_JIT
+
+// maximum number of register arguments of the x86-64 SysV calling convention
+# define JIT_MAX_GPR_ARGS 6
+# define JIT_MAX_SSE_ARGS 8
+// enough to hold the thunk of JIT_MAX_GPR_ARGS + JIT_MAX_SSE_ARGS arguments
+# define JIT_MAX_CODE_SIZE 256
+
+// emits a thunk that has the same signature as symstub_t:
+//
+//  push rbx
+//  mov  rbx, rsi                   ; retval
+//  mov  r11, rdx                   ; args
+//  mov  <gpr>, [r11 + i * 8]       ; integer and pointer arguments
+//  movsd/movss <xmm>, [r11 + i * 8]; double and float arguments
+//  mov  rax, <addr>
+//  call rax
+//  mov/movsd/movss [rbx], rax/xmm0 ; return value
+//  pop  rbx
+//  ret
+//
+// the thunk ignores the first argument, the address of the symbol is embedded
+// into the code. returns 0 if the signature cannot be passed in registers.
+static size_t jit_emit(syminfo_t *sym, uint8_t *code)
+{
+    // rdi, rsi, rdx, rcx, r8, r9
+    static const uint8_t GPR[JIT_MAX_GPR_ARGS] = {7, 6, 2, 1, 8, 9};
+    uint8_t *p                                 = code;
+    int ngpr                                   = 0;
+    int nsse                                   = 0;
+    uintptr_t addr                             = (uintptr_t)sym->addr;
+
+# define EMIT(...)                                                             \
+     do {                                                                      \
+         const uint8_t bytes_[] = {__VA_ARGS__};                               \
+         memcpy(p, bytes_, sizeof(bytes_));                                    \
+         p += sizeof(bytes_);                                                  \
+     } while (0)
+# define EMIT_U32(v)                                                           \
+     EMIT((uint8_t)(v), (uint8_t)((v) >> 8), (uint8_t)((v) >> 16),             \
+          (uint8_t)((v) >> 24))
+
+    // push rbx; mov rbx, rsi; mov r11, rdx
+    EMIT(0x53, 0x48, 0x89, 0xf3, 0x49, 0x89, 0xd3);
+
+    for (size_t i = 0; i < sym->sig->nargs; i++) {
+        uint32_t disp = (uint32_t)(i * sizeof(callval_u));
+        uint8_t reg   = 0;
+
+        switch (sym->sig->arg_types[i]) {
+        case T_FLOAT:
+        case T_DOUBLE:
+            if (nsse == JIT_MAX_SSE_ARGS) {
+                return 0;
+            }
+            reg = (uint8_t)nsse++;
+            // movss/movsd xmm<reg>, [r11 + disp32]
+            EMIT((sym->sig->arg_types[i] == T_FLOAT) ? 0xf3 : 0xf2, 0x41, 0x0f,
+                 0x10, (uint8_t)(0x80 | (reg << 3) | 3));
+            break;
+
+        default:
+            if (ngpr == JIT_MAX_GPR_ARGS) {
+                return 0;
+            }
+            reg = GPR[ngpr++];
+            // mov <reg>, [r11 + disp32]
+            EMIT((reg & 8) ? 0x4d : 0x49, 0x8b,
+                 (uint8_t)(0x80 | ((reg & 7) << 3) | 3));
+        }
+        EMIT_U32(disp);
+    }
+
+    // mov rax, imm64; call rax
+    EMIT(0x48, 0xb8);
+    EMIT_U32((uint32_t)addr);
+    EMIT_U32((uint32_t)(addr >> 32));
+    EMIT(0xff, 0xd0);
+
+    switch (sym->sig->ret_type) {
+    case T_VOID:
+        break;
+    case T_FLOAT:
+        // movss [rbx], xmm0
+        EMIT(0xf3, 0x0f, 0x11, 0x03);
+        break;
+    case T_DOUBLE:
+        // movsd [rbx], xmm0
+        EMIT(0xf2, 0x0f, 0x11, 0x03);
+        break;
+    default:
+        // mov [rbx], rax
+        EMIT(0x48, 0x89, 0x03);
+    }
+
+    // pop rbx; ret
+    EMIT(0x5b, 0xc3);
+
+# undef EMIT_U32
+# undef EMIT
+
+    return (size_t)(p - code);
+}
+
+// compiles a thunk into the executable pages of the dso, or returns NULL if
+// the signature is not supported or the page cannot be allocated. the thunks
+// share the pages, and a page is writable only while a thunk is copied into
+// it.
+static void *jit_compile(jitpage_t **pages, syminfo_t *sym)
+{
+    uint8_t code[JIT_MAX_CODE_SIZE];
+    size_t len      = jit_emit(sym, code);
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    jitpage_t *page = *pages;
+    uint8_t *thunk  = NULL;
+
+    if (len == 0) {
+        return NULL;
+    } else if (!page || page->used + len > pagesize) {
+        if (!(page = malloc(sizeof(jitpage_t)))) {
+            return NULL;
+        }
+        page->code = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (page->code == MAP_FAILED) {
+            free(page);
+            return NULL;
+        }
+        page->used = 0;
+        page->next = *pages;
+        *pages     = page;
+    } else if (mprotect(page->code, pagesize, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+
+    thunk = page->code + page->used;
+    memcpy(thunk, code, len);
+    if (mprotect(page->code, pagesize, PROT_READ | PROT_EXEC) != 0) {
+        // the page cannot be executed, do not use it anymore
+        page->used = pagesize;
+        return NULL;
+    }
+    // align the next thunk to 16 bytes
+    page->used += (len + 15) & ~(size_t)15;
+    return thunk;
+}
+
+static void jit_free(jitpage_t *pages)
+{
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+
+    while (pages) {
+        jitpage_t *page = pages;
+        pages           = page->next;
+        munmap(page->code, pagesize);
+        free(page);
+    }
+}
+
+#endif
+
+// call the symbol with the converted argument values
+static inline void invoke(syminfo_t *sym, callval_u *retval, callval_u *args)
+{
+    void *arg_values[FFI_MAX_ARGS];
+
+    if (sym->stub) {
+        sym->stub(sym->addr, retval, args);
+        return;
+    }
+    for (size_t i = 0; i < sym->sig->nargs; i++) {
+        arg_values[i] = &args[i];
+    }
+    ffi_call(&sym->sig->cif, FFI_FN(sym->addr), retval, arg_values);
+}
+
+// numeric types stored in the native memory, such as the elements of the
+// array and the fields of the struct. the values are converted with the
+// accessor of the integer or number kind.
+#define NUMERIC_TYPES(M)                                                       \
+    M(T_CHAR, char, integer)                                                   \
+    M(T_SCHAR, signed char, integer)                                           \
+    M(T_UCHAR, unsigned char, integer)                                         \
+    M(T_SHORT, short, integer)                                                 \
+    M(T_USHORT, unsigned short, integer)                                       \
+    M(T_INT8, int8_t, integer)                                                 \
+    M(T_UINT8, uint8_t, integer)                                               \
+    M(T_INT16, int16_t, integer)                                               \
+    M(T_UINT16, uint16_t, integer)                                             \
+    M(T_INT, int, integer)                                                     \
+    M(T_UINT, unsigned int, integer)                                           \
+    M(T_INT32, int32_t, integer)                                               \
+    M(T_UINT32, uint32_t, integer)                                             \
+    M(T_INT64, int64_t, integer)                                               \
+    M(T_UINT64, uint64_t, integer)                                             \
+    M(T_LONG, long, integer)                                                   \
+    M(T_ULONG, unsigned long, integer)                                         \
+    M(T_LONG_LONG, long long, integer)                                         \
+    M(T_ULONG_LONG, unsigned long long, integer)                               \
+    M(T_FLOAT, float, number)                                                  \
+    M(T_DOUBLE, double, number)                                                \
+    M(T_SIZE_T, size_t, integer)                                               \
+    M(T_SSIZE_T, ssize_t, integer)
+
+#define pushelem_integer(L, v) lua_pushinteger(L, (lua_Integer)(v))
+#define pushelem_number(L, v)  lua_pushnumber(L, (lua_Number)(v))
+
+// maximum size of the storage of the struct values of a call
+#define STRUCT_MAX_SCRATCH 1024
+
+static void tostruct(lua_State *L, int idx, int argn, structdef_t *def,
+                     char *mem);
+
+// converts the value on the top of the stack to the field of the struct
+static inline lua_Integer tofield_integer(lua_State *L, int argn,
+                                          structfield_t *field)
+{
+    lua_Integer v = 0;
+
+    if (!tointeger(L, -1, &v)) {
+        luaL_error(L, "argument %d: field '%s' must be an integer", argn,
+                   field->name);
+    }
+    return v;
+}
+
+#define tofield_number(L, argn, field) lua_tonumber(L, -1)
+
+static void tofield(lua_State *L, int argn, structdef_t *def,
+                    structfield_t *field, char *mem)
+{
+    int type   = lua_type(L, -1);
+    size_t len = 0;
+
+    if (type == LUA_TNIL) {
+        // the field is filled with zero
+        return;
+    }
+
+    switch (field->type) {
+    case T_STRUCT:
+        if (type == LUA_TTABLE) {
+            tostruct(L, lua_gettop(L), argn, field->def, mem);
+            return;
+        }
+        break;
+    case T_VOID_PTR:
+        if (type == LUA_TLIGHTUSERDATA) {
+            *(void **)mem = lua_touserdata(L, -1);
+            return;
+        } else if (type == LUA_TUSERDATA) {
+            if (!(*(void **)mem = tomemory(L, -1, &len))) {
+                *(void **)mem = lua_touserdata(L, -1);
+            }
+            return;
+        }
+        break;
+    case T_CHAR_PTR:
+        if (type == LUA_TSTRING) {
+            *(const char **)mem = lua_tostring(L, -1);
+            return;
+        } else if (type == LUA_TUSERDATA &&
+                   (*(void **)mem = tomemory(L, -1, &len))) {
+            return;
+        }
+        break;
+    default:
+        if (type != LUA_TNUMBER) {
+            break;
+        }
+        switch (field->type) {
+        default:
+            break;
+#define TOFIELD_CASE(TYPE_ENUM, CTYPE, KIND)                                   \
+    case TYPE_ENUM:                                                            \
+        *(CTYPE *)mem = (CTYPE)tofield_##KIND(L, argn, field);                 \
+        break;
+
+            NUMERIC_TYPES(TOFIELD_CASE)
+#undef TOFIELD_CASE
+        }
+        return;
+    }
+    luaL_error(L, "argument %d: field '%s' of struct %s requires %s, got %s",
+               argn, field->name, def->name,
+               (field->type == T_STRUCT) ? "table" : TYPE_NAMES[field->type],
+               lua_typename(L, type));
+}
+
+// converts the table at idx to the struct value
+static void tostruct(lua_State *L, int idx, int argn, structdef_t *def,
+                     char *mem)
+{
+    if (lua_type(L, idx) != LUA_TTABLE) {
+        luaL_error(L, "argument %d: struct %s requires table, got %s", argn,
+                   def->name, luaL_typename(L, idx));
+    }
+    memset(mem, 0, def->type.size);
+    for (size_t i = 0; i < def->nfields; i++) {
+        structfield_t *field = &def->fields[i];
+        lua_getfield(L, idx, field->name);
+        tofield(L, argn, def, field, mem + field->offset);
+        lua_pop(L, 1);
+    }
+}
+
+static int pushstruct(lua_State *L, structdef_t *def, const char *mem);
+
+// pushes the value of the type stored in the memory. def is the struct type
+// if the type is T_STRUCT.
+static void pushmem(lua_State *L, datatype_t type, structdef_t *def,
+                    const char *p)
+{
+    switch (type) {
+    default:
+        lua_pushnil(L);
+        break;
+    case T_STRUCT:
+        pushstruct(L, def, p);
+        break;
+    case T_VOID_PTR:
+        (*(void **)p) ? lua_pushlightuserdata(L, *(void **)p) : lua_pushnil(L);
+        break;
+    case T_CHAR_PTR:
+        (*(char **)p) ? lua_pushstring(L, *(char **)p) : lua_pushnil(L);
+        break;
+#define PUSHMEM_CASE(TYPE_ENUM, CTYPE, KIND)                                   \
+    case TYPE_ENUM:                                                            \
+        pushelem_##KIND(L, *(const CTYPE *)p);                                 \
+        break;
+
+        NUMERIC_TYPES(PUSHMEM_CASE)
+#undef PUSHMEM_CASE
+    }
+}
+
+// pushes the struct value as a table
+static int pushstruct(lua_State *L, structdef_t *def, const char *mem)
+{
+    luaL_checkstack(L, 3, NULL);
+    lua_createtable(L, 0, (int)def->nfields);
+    for (size_t i = 0; i < def->nfields; i++) {
+        structfield_t *field = &def->fields[i];
+        pushmem(L, field->type, field->def, mem + field->offset);
+        lua_setfield(L, -2, field->name);
+    }
+    return 1;
+}
+
+// enter the call of a C function from the thread L, and returns the thread
+// that was in the call
+static inline lua_State *call_enter(lua_State *L, caller_t *caller)
+{
+    lua_State *prev = caller->thread;
+
+    caller->thread = L;
+    return prev;
+}
+
+// leave the call of a C function, and raise the error raised by a callback
+// during the call
+static inline void call_leave(lua_State *L, caller_t *caller, lua_State *prev)
+{
+    caller->thread = prev;
+    if (caller->err != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, caller->err);
+        luaL_unref(L, LUA_REGISTRYINDEX, caller->err);
+        caller->err = LUA_NOREF;
+        lua_error(L);
+    }
+}
+
+// push the returned string with the length specified by the retlen option
+static int pushret_lstring(lua_State *L, syminfo_t *sym, callval_u *retval,
+                           callval_u *args, callval_u *outs)
+{
+    lua_Integer len = 0;
+
+    if (!retval->p) {
+        lua_pushnil(L);
+        return 1;
+    } else if (sym->lensym) {
+        // call the paired symbol with the same arguments. its output
+        // arguments point to a copy of the output values, so that it does not
+        // overwrite the values returned by the symbol.
+        signature_t *sig = sym->sig;
+        callval_u lenval;
+        callval_u lenargs[FFI_MAX_ARGS * 2];
+        callval_u *lenouts = lenargs + FFI_MAX_ARGS;
+        lua_State *prev    = NULL;
+
+        if (sig->nouts) {
+            memcpy(lenargs, args, sizeof(callval_u) * sig->nargs);
+            for (size_t i = 0; i < sig->nouts; i++) {
+                lenouts[i]              = outs[i];
+                lenargs[sig->outs[i]].p = &lenouts[i];
+            }
+            args = lenargs;
+        }
+        prev = call_enter(L, sym->caller);
+        invoke(sym->lensym, &lenval, args);
+        call_leave(L, sym->caller, prev);
+        sym->lensym->sig->pushret(L, &lenval);
+        len = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    } else {
+        len = (lua_Integer)outs[sym->sig->lenout].sz;
+    }
+
+    (len < 0) ? lua_pushnil(L) : lua_pushlstring(L, retval->p, (size_t)len);
+    return 1;
+}
+
+// push the output values after the return value, except the length of the
+// returned string
+static int pushouts(lua_State *L, syminfo_t *sym, callval_u *outs)
+{
+    signature_t *sig = sym->sig;
+    int n            = 0;
+
+    luaL_checkstack(L, (int)sig->nouts, NULL);
+    for (size_t i = 0; i < sig->nouts; i++) {
+        if ((int)i != sig->lenout) {
+            n += sig->pushouts[i](L, &outs[i]);
+        }
+    }
+    return n;
+}
+
+// push the errno captured after the call as the last result if the symbol is
+// declared with the errno option
+static inline int pusherrno(lua_State *L, syminfo_t *sym, int err)
+{
+    if (sym->flags & SYM_ERRNO) {
+        luaL_checkstack(L, 1, NULL);
+        lua_pushinteger(L, err);
+        return 1;
+    }
+    return 0;
+}
+
+// call the symbol that takes or returns the struct values. the struct values
+// are stored in the scratch storage on the C stack, and they are passed to
+// ffi_call by the address.
+static int structcall(lua_State *L, syminfo_t *sym, int base)
+{
+    signature_t *sig = sym->sig;
+    int nargs        = lua_gettop(L) - base + 1;
+    callval_u retval;
+    callval_u args[FFI_MAX_ARGS * 2];
+    callval_u *outs = args + FFI_MAX_ARGS;
+    callval_u scratch[STRUCT_MAX_SCRATCH / sizeof(callval_u)];
+    void *arg_values[FFI_MAX_ARGS];
+    char *mem       = (char *)scratch;
+    lua_State *prev = NULL;
+    int nres        = 0;
+    int err         = 0;
+
+    for (size_t i = 0; i < sig->nargs; i++) {
+        arg_values[i] = &args[i];
+    }
+    for (size_t i = 0; i < sig->nouts; i++) {
+        outs[i].u64          = 0;
+        args[sig->outs[i]].p = &outs[i];
+    }
+    // convert arguments
+    for (int i = 0; i < nargs; i++) {
+        uint8_t slot     = sig->slots[i];
+        structdef_t *def = NULL;
+
+        if (slot < FFI_MAX_ARGS && (def = sig->arg_structs[slot])) {
+            tostruct(L, base + i, i + 1, def, mem);
+            arg_values[slot] = mem;
+            mem += (def->type.size + 7) & ~(size_t)7;
+            continue;
+        }
+        sig->toargs[i](L, base + i, i + 1, &args[slot]);
+    }
+
+    // call symbol function
+    prev = call_enter(L, sym->caller);
+    if (sym->flags & SYM_ERRNO) {
+        errno = 0;
+    }
+    if (sig->ret_struct) {
+        ffi_call(&sig->cif, FFI_FN(sym->addr), mem, arg_values);
+        if (sym->flags & SYM_ERRNO) {
+            err = *sym->errslot = errno;
+        }
+        call_leave(L, sym->caller, prev);
+        nres = pushstruct(L, sig->ret_struct, mem);
+    } else {
+        ffi_call(&sig->cif, FFI_FN(sym->addr), &retval, arg_values);
+        if (sym->flags & SYM_ERRNO) {
+            err = *sym->errslot = errno;
+        }
+        call_leave(L, sym->caller, prev);
+        if (sig->lenout >= 0) {
+            nres = pushret_lstring(L, sym, &retval, args, outs);
+        } else {
+            nres = sig->pushret(L, &retval);
+        }
+    }
+    if (sig->nouts) {
+        nres += pushouts(L, sym, outs);
+    }
+    return nres + pusherrno(L, sym, err);
+}
+
+// maximum number of the call interfaces cached by a variadic function
+#define VARCIF_MAX 16
+
+// find the call interface for the signature of the variadic arguments, or
+// prepare and cache it if not found
+static varcif_t *getvarcif(lua_State *L, syminfo_t *sym, int idx)
+{
+    size_t len      = 0;
+    const char *sig = lua_tolstring(L, idx, &len);
+    const char *end = sig + len;
+    size_t nargs    = sym->sig->nargs;
+    size_t ntail    = 0;
+    datatype_t types[FFI_MAX_ARGS];
+    varcif_t **prev = &sym->varcifs;
+    varcif_t *vc    = NULL;
+    ffi_status st   = FFI_OK;
+
+    if (!sig) {
+        luaL_error(L,
+                   "argument %d: signature of the variadic arguments "
+                   "requires string, got %s",
+                   (int)sym->sig->nparams + 1, luaL_typename(L, idx));
+    }
+
+    // parse the comma separated types. the empty string has no types.
+    while (len) {
+        const char *head  = sig;
+        const char *comma = memchr(sig, ',', (size_t)(end - sig));
+        const char *tail  = comma ? comma : end;
+        int t             = 0;
+
+        // trim spaces
+        while (head < tail && *head == ' ') {
+            head++;
+        }
+        while (tail > head && tail[-1] == ' ') {
+            tail--;
+        }
+        if (head == tail) {
+            luaL_error(L, "empty type in the signature of the variadic "
+                          "arguments");
+        } else if (nargs + ntail == FFI_MAX_ARGS) {
+            luaL_error(L, "number of C arguments must be at most %d",
+                       FFI_MAX_ARGS);
+        }
+        t = find_type(head, (size_t)(tail - head));
+        switch (t) {
+        case -1:
+        case T_VOID:
+        case T_BYTES:
+            lua_pushlstring(L, head, (size_t)(tail - head));
+            luaL_error(L, "invalid type of variadic argument '%s'",
+                       lua_tostring(L, -1));
+            break;
+        // default argument promotions
+        case T_FLOAT:
+            t = T_DOUBLE;
+            break;
+        case T_CHAR:
+        case T_SCHAR:
+        case T_UCHAR:
+        case T_SHORT:
+        case T_USHORT:
+        case T_INT8:
+        case T_UINT8:
+        case T_INT16:
+        case T_UINT16:
+            t = T_INT;
+            break;
+        }
+        types[ntail++] = (datatype_t)t;
+        if (!comma) {
+            break;
+        }
+        sig = comma + 1;
+    }
+
+    // the signatures of the same types share the call interface
+    for (vc = sym->varcifs; vc; prev = &vc->next, vc = vc->next) {
+        if (vc->ntail == ntail &&
+            memcmp(vc->types, types, sizeof(datatype_t) * ntail) == 0) {
+            // move to the front, so that the repeated shape is found first
+            *prev        = vc->next;
+            vc->next     = sym->varcifs;
+            sym->varcifs = vc;
+            return vc;
+        }
+    }
+
+    if (!(vc = malloc(sizeof(varcif_t)))) {
+        luaL_error(L, "failed to allocate memory for variadic arguments");
+    }
+    vc->ntail = ntail;
+    memcpy(vc->types, types, sizeof(datatype_t) * ntail);
+    memcpy(vc->ffi_types, sym->sig->arg_ffi_types, sizeof(ffi_type *) * nargs);
+    for (size_t i = 0; i < ntail; i++) {
+        vc->ffi_types[nargs + i] = datatype_ffi(types[i]);
+        vc->toargs[i] = ((sym->flags & SYM_UNCHECKED) ? UNCHECKED_TOARGS :
+                                                        TOARGS)[types[i]];
+    }
+
+    st = ffi_prep_cif_var(&vc->cif, FFI_DEFAULT_ABI, (unsigned int)nargs,
+                          (unsigned int)(nargs + ntail),
+                          sym->sig->ret_ffi_type, vc->ffi_types);
+    if (st != FFI_OK) {
+        free(vc);
+        luaL_error(L, "failed to prepare FFI call interface for symbol '%s' "
+                      "(%s)",
+                   sym->name, ffi_status_message(st));
+    }
+    vc->next     = sym->varcifs;
+    sym->varcifs = vc;
+
+    // drop the least recently used ones
+    prev = &vc->next;
+    for (size_t i = 1; *prev && i < VARCIF_MAX; i++) {
+        prev = &(*prev)->next;
+    }
+    while (*prev) {
+        varcif_t *old = *prev;
+        *prev         = old->next;
+        free(old);
+    }
+    return vc;
+}
+
+// call the variadic function. the signature of the variadic arguments is
+// passed after the fixed arguments, e.g. lib:printf('%d %s', 'int,char*', 1,
+// 'a').
+static int varcall(lua_State *L, syminfo_t *sym, int base)
+{
+    signature_t *sig = sym->sig;
+    int nargs        = lua_gettop(L) - base + 1;
+    callval_u retval;
+    callval_u args[FFI_MAX_ARGS * 2];
+    callval_u *outs = args + FFI_MAX_ARGS;
+    void *arg_values[FFI_MAX_ARGS];
+    varcif_t *vc    = NULL;
+    lua_State *prev = NULL;
+    int nres        = 0;
+    int err         = 0;
+
+    if (nargs < (int)sig->nparams + 1) {
+        return luaL_error(L,
+                          "invalid number of arguments for symbol '%s': "
+                          "expected at least %d but got %d",
+                          sym->name, (int)sig->nparams + 1, nargs);
+    }
+    vc = getvarcif(L, sym, base + (int)sig->nparams);
+    if (nargs != (int)(sig->nparams + 1 + vc->ntail)) {
+        return luaL_error(L,
+                          "invalid number of arguments for symbol '%s': "
+                          "expected %d but got %d",
+                          sym->name, (int)(sig->nparams + 1 + vc->ntail),
+                          nargs);
+    }
+
+    for (size_t i = 0; i < sig->nouts; i++) {
+        outs[i].u64          = 0;
+        args[sig->outs[i]].p = &outs[i];
+    }
+    // convert the fixed and the variadic arguments
+    for (size_t i = 0; i < sig->nparams; i++) {
+        sig->toargs[i](L, base + (int)i, (int)i + 1, &args[sig->slots[i]]);
+    }
+    base += (int)sig->nparams + 1;
+    for (size_t i = 0; i < vc->ntail; i++) {
+        vc->toargs[i](L, base + (int)i, (int)(sig->nparams + 2 + i),
+                      &args[sig->nargs + i]);
+    }
+    for (size_t i = 0; i < sig->nargs + vc->ntail; i++) {
+        arg_values[i] = &args[i];
+    }
+
+    prev = call_enter(L, sym->caller);
+    if (sym->flags & SYM_ERRNO) {
+        errno = 0;
+    }
+    ffi_call(&vc->cif, FFI_FN(sym->addr), &retval, arg_values);
+    if (sym->flags & SYM_ERRNO) {
+        err = *sym->errslot = errno;
+    }
+    call_leave(L, sym->caller, prev);
+    if (sig->lenout >= 0) {
+        nres = pushret_lstring(L, sym, &retval, args, outs);
+    } else {
+        nres = sig->pushret(L, &retval);
+    }
+    if (sig->nouts) {
+        nres += pushouts(L, sym, outs);
+    }
+    return nres + pusherrno(L, sym, err);
+}
+
+static int resolve_symbol(lua_State *L, dso_t *dso, syminfo_t *sym);
+
+// resolve the symbol declared with the lazy option, and the length symbol
+// called with it. raises an error if failed.
+static void resolve_lazy(lua_State *L, syminfo_t *sym)
+{
+    if (!sym->dso) {
+        luaL_error(L, "module is closed");
+    } else if (sym->lensym && !sym->lensym->addr) {
+        resolve_lazy(L, sym->lensym);
+    }
+    if (resolve_symbol(L, sym->dso, sym) != 0) {
+        luaL_error(L, "%s", lua_tostring(L, -1));
+    }
+}
+
+// call the symbol with the arguments starting at the stack index 'base'
+static inline int symcall(lua_State *L, syminfo_t *sym, int base)
+{
+    signature_t *sig = sym->sig;
+    int nargs        = lua_gettop(L) - base + 1;
+    // every member of callval_u is placed at offset 0, so the return value
+    // and the argument values can be stored without any per-type offsets.
+    // only the slots used by the signature are touched.
+    callval_u retval;
+    // the second half stores the values of the output arguments
+    callval_u args[FFI_MAX_ARGS * 2];
+    callval_u *outs = args + FFI_MAX_ARGS;
+    lua_State *prev = NULL;
+    int nres        = 0;
+    int err         = 0;
+
+    // check if module is closed, or resolve the lazy symbol
+    if (!sym->addr) {
+        resolve_lazy(L, sym);
+    }
+    if (sym->flags & SYM_VARIADIC) {
+        return varcall(L, sym, base);
+    }
+
+    // check number of arguments
+    if (sig->nparams != (size_t)nargs) {
+        return luaL_error(L,
+                          "invalid number of arguments for symbol '%s': "
+                          "expected %d but got %d",
+                          sym->name, (int)sig->nparams, nargs);
+    } else if (sym->flags & SYM_STRUCT) {
+        return structcall(L, sym, base);
+    }
+
+    // pass the address of the output values. the input values of the in/out
+    // arguments are stored by the converters.
+    for (size_t i = 0; i < sig->nouts; i++) {
+        outs[i].u64          = 0;
+        args[sig->outs[i]].p = &outs[i];
+    }
+    // convert arguments
+    for (int i = 0; i < nargs; i++) {
+        sig->toargs[i](L, base + i, i + 1, &args[sig->slots[i]]);
+    }
+
+    // call symbol function. errno is captured before the Lua API or the
+    // length symbol can change it.
+    prev = call_enter(L, sym->caller);
+    if (sym->flags & SYM_ERRNO) {
+        errno = 0;
+        invoke(sym, &retval, args);
+        err = *sym->errslot = errno;
+    } else {
+        invoke(sym, &retval, args);
+    }
+    call_leave(L, sym->caller, prev);
+
+    // push return value
+    if (sym->lensym || sig->lenout >= 0) {
+        nres = pushret_lstring(L, sym, &retval, args, outs);
+    } else {
+        nres = sig->pushret(L, &retval);
+    }
+    if (sig->nouts) {
+        nres += pushouts(L, sym, outs);
+    }
+    return nres + pusherrno(L, sym, err);
+}
+
+static int symcall_lua(lua_State *L)
+{
+    // exclude module userdata
+    return symcall(L, (syminfo_t *)lua_touserdata(L, lua_upvalueindex(1)), 2);
+}
+
+static int symfunc_lua(lua_State *L)
+{
+    // arguments start at slot 1, the dso is held by the second upvalue
+    return symcall(L, (syminfo_t *)lua_touserdata(L, lua_upvalueindex(1)), 1);
+}
+
+static int gc_lua(lua_State *L);
+
+// each dso has its own metatable (see new_lua), so luaL_checkudata cannot be
+// used to check the type. a dso is identified by the __gc metamethod of its
+// metatable instead.
+static dso_t *checkdso(lua_State *L, int idx)
+{
+    dso_t *dso = (dso_t *)lua_touserdata(L, idx);
+
+    if (dso && lua_getmetatable(L, idx)) {
+        lua_pushliteral(L, "__gc");
+        lua_rawget(L, -2);
+        if (lua_tocfunction(L, -1) == gc_lua) {
+            lua_pop(L, 2);
+            return dso;
+        }
+        lua_pop(L, 2);
+    }
+    luaL_argerror(L, idx, MODULE_MT " expected");
+    return NULL;
+}
+
+// returns the struct type at idx specified by the type object or the name of
+// the defined struct, or NULL if the value is not a struct type
+static structdef_t *tostructdef(lua_State *L, int idx)
+{
+    structdef_t *def = NULL;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TUSERDATA:
+        if (lua_getmetatable(L, idx)) {
+            luaL_getmetatable(L, STRUCT_MT);
+            if (lua_rawequal(L, -1, -2)) {
+                def = (structdef_t *)lua_touserdata(L, idx);
+            }
+            lua_pop(L, 2);
+        }
+        return def;
+
+    case LUA_TSTRING:
+        lua_getfield(L, LUA_REGISTRYINDEX, STRUCT_TYPES);
+        lua_pushvalue(L, idx);
+        lua_rawget(L, -2);
+        def = (structdef_t *)lua_touserdata(L, -1);
+        lua_pop(L, 2);
+        return def;
+
+    default:
+        return NULL;
+    }
+}
+
+// returns the per-state slot of the errno captured by the last call of the
+// symbol declared with the errno option
+static int *errno_slot(lua_State *L)
+{
+    int *slot = NULL;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, ERRNO_SLOT);
+    slot = (int *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return slot;
+}
+
+static caller_t *caller_slot(lua_State *L)
+{
+    caller_t *slot = NULL;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, CALLER_SLOT);
+    slot = (caller_t *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return slot;
+}
+
+static inline int optboolean(lua_State *L, int idx, const char *k)
+{
+    int b = 0;
+    if (idx) {
+        lua_getfield(L, idx, k);
+        b = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    return b;
+}
+
+// returns the reason why the pair cannot return the length of the string
+// returned by the symbol of sig, or NULL if it can. the pair is called with
+// the same arguments, so it must have the same argument types.
+static const char *check_retlen_pair(const signature_t *sig,
+                                     const syminfo_t *pair)
+{
+    if (pair->flags & (SYM_STRUCT | SYM_VARIADIC)) {
+        return "cannot take struct or variadic arguments";
+    }
+    switch (pair->sig->ret_type) {
+    case T_VOID:
+    case T_VOID_PTR:
+    case T_CHAR_PTR:
+    case T_FLOAT:
+    case T_DOUBLE:
+    case T_STRUCT:
+        return "must return an integer";
+    default:
+        break;
+    }
+    if (pair->sig->nargs != sig->nargs ||
+        memcmp(pair->sig->arg_types, sig->arg_types,
+               sizeof(datatype_t) * sig->nargs) != 0 ||
+        memcmp(pair->sig->arg_bases, sig->arg_bases,
+               sizeof(datatype_t) * sig->nargs) != 0) {
+        return "must have the same argument types";
+    }
+    return NULL;
+}
+
+// check the retlen option of dlsym. the option specifies the length of the
+// returned char* with one of the following values;
+//  integer: position of the size_t* argument that receives the length. the
+//           output value is not returned as the extra result.
+//   string: name of the defined symbol that returns the length. it is called
+//           with the same arguments after the call of the symbol.
+// returns non-zero with false and an error message on the stack if failed.
+static int check_retlen(lua_State *L, int opts, dso_t *dso, syminfo_t *sym)
+{
+    signature_t *sig = sym->sig;
+    int rv           = 0;
+
+    if (opts) {
+        lua_getfield(L, opts, "retlen");
+    } else {
+        lua_pushnil(L);
+    }
+
+    switch (lua_type(L, -1)) {
+    case LUA_TNIL:
+        break;
+
+    case LUA_TNUMBER: {
+        lua_Integer pos = lua_tointeger(L, -1);
+        // convert the position of the declared argument to the C argument
+        for (size_t i = 0; i < sig->nargs && (lua_Integer)i < pos; i++) {
+            pos += (sig->arg_types[i] == T_BYTES);
+        }
+        if (sig->ret_type != T_CHAR_PTR) {
+            lua_pushfstring(L, "retlen requires char* return type");
+            rv = 1;
+        } else if (pos < 1 || pos > (lua_Integer)sig->nargs ||
+                   (sig->arg_types[pos - 1] != T_OUT &&
+                    sig->arg_types[pos - 1] != T_INOUT) ||
+                   sig->arg_bases[pos - 1] != T_SIZE_T) {
+            lua_pushfstring(L, "retlen must be the position of a size_t* "
+                               "argument");
+            rv = 1;
+        } else {
+            // C argument index, converted to the index of outs by dlsym
+            sig->lenout = (int)(pos - 1);
+        }
+    } break;
+
+    case LUA_TSTRING: {
+        const char *name   = lua_tostring(L, -1);
+        const char *reason = NULL;
+        syminfo_t *pair    = NULL;
+
+        if (sig->ret_type != T_CHAR_PTR) {
+            lua_pushfstring(L, "retlen requires char* return type");
+            rv = 1;
+            break;
+        } else if (sym->flags & (SYM_STRUCT | SYM_VARIADIC)) {
+            lua_pushfstring(L, "retlen symbol cannot be used with struct "
+                               "or variadic arguments");
+            rv = 1;
+            break;
+        }
+        // find the latest definition of the symbol
+        for (syminfo_t *it = dso->symbols_head; it; it = it->next) {
+            if (strcmp(it->name, name) == 0) {
+                pair = it;
+            }
+        }
+        if (!pair) {
+            lua_pushfstring(L, "retlen symbol '%s' is not defined", name);
+            rv = 1;
+            break;
+        }
+        if ((reason = check_retlen_pair(sig, pair))) {
+            lua_pushfstring(L, "retlen symbol '%s' %s", name, reason);
+            rv = 1;
+            break;
+        }
+        sym->lensym = pair;
+    } break;
+
+    default:
+        lua_pushfstring(L, "retlen must be integer or string, got %s",
+                        luaL_typename(L, -1));
+        rv = 1;
+    }
+
+    if (rv) {
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 1;
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+// the signatures are interned in the process-wide table, so that the symbols
+// of the same signature share the prepared call interface and the marshaling
+// plan. the signatures with the struct values are not interned, since the
+// struct types belong to the Lua state.
+#define SIGNATURES_SIZE 256
+
+static signature_t *SIGNATURES[SIGNATURES_SIZE];
+static pthread_mutex_t SIGNATURES_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// signature of the symbols of the closed dso
+static signature_t SIG_CLOSED;
+
+static signature_t **signature_bucket(const signature_t *sig)
+{
+    const uint8_t *key = (const uint8_t *)sig;
+    uint32_t hash      = 2166136261u;
+
+    // FNV-1a
+    for (size_t i = 0; i < SIGNATURE_KEYLEN; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return &SIGNATURES[hash % SIGNATURES_SIZE];
+}
+
+// returns the interned signature identical to the key of tmp, or a new
+// signature prepared from tmp. returns NULL with an error message on the
+// stack if failed.
+static signature_t *intern_signature(lua_State *L, const signature_t *tmp)
+{
+    signature_t **bucket = NULL;
+    signature_t *sig     = NULL;
+    ffi_status status    = FFI_OK;
+
+    if (!(tmp->flags & SYM_STRUCT)) {
+        bucket = signature_bucket(tmp);
+        pthread_mutex_lock(&SIGNATURES_LOCK);
+        for (sig = *bucket; sig; sig = sig->next) {
+            if (memcmp(sig, tmp, SIGNATURE_KEYLEN) == 0) {
+                sig->refs++;
+                pthread_mutex_unlock(&SIGNATURES_LOCK);
+                return sig;
+            }
+        }
+    }
+
+    if ((sig = malloc(sizeof(signature_t)))) {
+        memcpy(sig, tmp, sizeof(signature_t));
+        sig->refs = 1;
+        // prepare FFI call interface. the call interface of the variadic
+        // function is prepared for each signature of the variadic arguments
+        // at the call.
+        status = ffi_prep_cif(&sig->cif, FFI_DEFAULT_ABI, sig->nargs,
+                              sig->ret_ffi_type, sig->arg_ffi_types);
+        if (status != FFI_OK) {
+            free(sig);
+            sig = NULL;
+        } else if (bucket) {
+            sig->next = *bucket;
+            *bucket   = sig;
+        }
+    }
+    if (bucket) {
+        pthread_mutex_unlock(&SIGNATURES_LOCK);
+    }
+
+    if (!sig && status == FFI_OK) {
+        lua_pushliteral(L, "failed to allocate memory for signature");
+    } else if (!sig) {
+        lua_pushfstring(L, "failed to prepare FFI call interface (%s)",
+                        ffi_status_message(status));
+    }
+    return sig;
+}
+
+static void release_signature(signature_t *sig)
+{
+    if (sig->flags & SYM_STRUCT) {
+        free(sig);
+        return;
+    }
+    pthread_mutex_lock(&SIGNATURES_LOCK);
+    if (--sig->refs == 0) {
+        signature_t **it = signature_bucket(sig);
+
+        while (*it != sig) {
+            it = &(*it)->next;
+        }
+        *it = sig->next;
+        free(sig);
+    }
+    pthread_mutex_unlock(&SIGNATURES_LOCK);
+}
+
+// resolve the address of the symbol, and select the call stub. returns
+// non-zero with an error message on the stack if failed.
+static int resolve_symbol(lua_State *L, dso_t *dso, syminfo_t *sym)
+{
+    // find symbol address
+    if (!(sym->addr = dlsym(dso->handle, sym->name))) {
+        lua_pushfstring(L, "failed to find symbol '%s': %s", sym->name,
+                        dlerror());
+        return 1;
+    }
+    // use the jit thunk or the direct call stub for the signature if exists.
+    // the struct values and the variadic arguments are always passed via
+    // ffi_call.
+#ifdef DLOPEN_JIT
+    if (!(sym->flags & (SYM_STRUCT | SYM_VARIADIC))) {
+        sym->stub = (symstub_t)jit_compile(&dso->jit, sym);
+    }
+#endif
+    if (!sym->stub && !(sym->flags & (SYM_STRUCT | SYM_VARIADIC))) {
+        sym->stub = select_stub(sym);
+    }
+    return 0;
+}
+
+// bind the symbol whose signature is set in the syminfo on the top of the
+// stack. lenout of the signature is the C argument index of the retlen output
+// argument, or -1. the dso must be at the stack index 1.
+// returns 1 with true, or 2 with false and an error message on the stack.
+static int bind_symbol(lua_State *L, dso_t *dso, syminfo_t *sym,
+                       const char *name, size_t len, char *namebuf)
+{
+    const toarg_t *conv =
+        (sym->flags & SYM_UNCHECKED) ? UNCHECKED_TOARGS : TOARGS;
+    signature_t *sig    = sym->sig;
+    int lenarg          = sig->lenout;
+    int ismethod        = 0;
+
+    // the symbol of the name of a method cannot be called by dso:<name>(),
+    // func() and callmany(), since the method shadows it
+    lua_getmetatable(L, 1);
+    lua_pushliteral(L, "__index");
+    lua_rawget(L, -2);
+    lua_pushlstring(L, name, len);
+    lua_rawget(L, -2);
+    ismethod = !lua_isnil(L, -1) && lua_tocfunction(L, -1) != symcall_lua;
+    lua_pop(L, 3);
+    if (ismethod) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "'%s' is the name of a method", name);
+        return 2;
+    }
+
+    // compile the marshaling plan
+    sig->lenout  = -1;
+    sig->nparams = 0;
+    sig->nouts   = 0;
+    for (size_t i = 0; i < sig->nargs; i++) {
+        if (sig->arg_types[i] == T_OUT || sig->arg_types[i] == T_INOUT) {
+            size_t k = sig->nouts++;
+
+            sig->outs[k]     = (uint8_t)i;
+            sig->pushouts[k] = PUSHRETS[sig->arg_bases[i]];
+            if ((int)i == lenarg) {
+                // receives the length of the returned string
+                sig->lenout = (int)k;
+            }
+            if (sig->arg_types[i] == T_INOUT) {
+                // the input value is stored in the output value
+                sig->toargs[sig->nparams]  = conv[sig->arg_bases[i]];
+                sig->slots[sig->nparams++] = (uint8_t)(FFI_MAX_ARGS + k);
+            }
+            continue;
+        }
+        sig->toargs[sig->nparams]  = conv[sig->arg_types[i]];
+        sig->slots[sig->nparams++] = (uint8_t)i;
+        // skip the length argument of bytes
+        i += (sig->arg_types[i] == T_BYTES);
+    }
+
+    // compute the size of the storage of the struct values
+    sig->scratch = 0;
+    for (size_t i = 0; i < sig->nargs; i++) {
+        if (sig->arg_structs[i]) {
+            sig->scratch += (sig->arg_structs[i]->type.size + 7) & ~(size_t)7;
+        }
+    }
+    if (sig->ret_struct) {
+        // ffi_call may write the return value in the size of the registers
+        sig->scratch += (sig->ret_struct->type.size + 15) & ~(size_t)15;
+        sig->scratch += 16;
+    }
+    if (sig->scratch > STRUCT_MAX_SCRATCH) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "total size of struct values must be at most %d",
+                        STRUCT_MAX_SCRATCH);
+        return 2;
+    } else if ((sym->flags & SYM_VARIADIC) && (sym->flags & SYM_STRUCT)) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "variadic function cannot take struct values");
+        return 2;
+    }
+
+    // copy symbol name
+    if (namebuf) {
+        sym->name = memcpy(namebuf, name, len + 1);
+        sym->flags |= SYM_NAMEBLOCK;
+    } else if (!(sym->name = strdup(name))) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "failed to allocate memory for symbol name");
+        return 2;
+    }
+
+    // share the identical signature
+    sig->flags  = sym->flags & (SYM_UNCHECKED | SYM_STRUCT | SYM_VARIADIC);
+    sig->lenarg = lenarg;
+    if (!(sym->sig = intern_signature(L, sig))) {
+        if (!namebuf) {
+            free(sym->name);
+        }
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    // resolve the symbol now, or on the first call if lazy. the lazy length
+    // symbol of the symbol resolved now is also resolved, since the call does
+    // not check it.
+    sym->caller  = caller_slot(L);
+    sym->varcifs = NULL;
+    sym->addr    = NULL;
+    sym->stub    = NULL;
+    sym->dso     = NULL;
+    if (sym->flags & SYM_LAZY) {
+        sym->dso = dso;
+    } else if (resolve_symbol(L, dso, sym) != 0 ||
+               (sym->lensym && !sym->lensym->addr &&
+                resolve_symbol(L, dso, sym->lensym) != 0)) {
+        release_signature(sym->sig);
+        if (!namebuf) {
+            free(sym->name);
+        }
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    // create the call closure once and keep reference to it.
+    // the closure holds syminfo as its upvalue, so it keeps syminfo alive.
+    lua_pushcclosure(L, symcall_lua, 1);
+    lua_pushvalue(L, -1);
+    sym->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    // register the closure to the method table of the dso, so that the VM
+    // resolves dso:<name>() with a table lookup
+    lua_getmetatable(L, 1);
+    lua_pushliteral(L, "__index");
+    lua_rawget(L, -2);
+    lua_pushlstring(L, name, len);
+    lua_pushvalue(L, -4);
+    lua_rawset(L, -3);
+    lua_pop(L, 3);
+
+    // append to symbol list
+    sym->next = NULL;
+    if (!dso->symbols_head) {
+        dso->symbols_head = sym;
+        dso->symbols_tail = sym;
+    } else {
+        dso->symbols_tail->next = sym;
+        dso->symbols_tail       = sym;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// define the symbol with the arguments on the stack;
+//   dso, return_type, function_name, argument_types... [, options]
+// the symbol name is copied to namebuf if not NULL, otherwise it is allocated.
+static int define_symbol(lua_State *L, char *namebuf)
+{
+    int nargs        = lua_gettop(L) - 1;
+    dso_t *dso       = checkdso(L, 1);
+    int opts         = 0;
+    size_t len       = 0;
+    const char *name = NULL;
+    syminfo_t *sym   = NULL;
+    signature_t buf;
+    signature_t *sig = &buf;
+
+    // check if module is closed
+    if (!dso->handle) {
+        return luaL_error(L, "module is closed");
+    }
+
+    // the last argument can be the options table
+    if (nargs > 0 && lua_type(L, nargs + 1) == LUA_TTABLE) {
+        opts = nargs + 1;
+        nargs--;
+    }
+    // the signature is interned by bind_symbol
+    memset(sig, 0, sizeof(signature_t));
+    sym        = lua_newuserdata(L, sizeof(syminfo_t));
+    sym->flags = 0;
+    sym->sig   = sig;
+    if (optboolean(L, opts, "unchecked")) {
+        sym->flags |= SYM_UNCHECKED;
+    }
+    if (optboolean(L, opts, "lazy")) {
+        sym->flags |= SYM_LAZY;
+    }
+    sym->errslot = NULL;
+    if (optboolean(L, opts, "errno")) {
+        sym->flags |= SYM_ERRNO;
+        sym->errslot = errno_slot(L);
+    }
+
+    // number of arguments must be FFI_MAX_ARGS + 2
+    // +2 for including return-type and function-name
+    if (nargs < 2 || nargs > FFI_MAX_ARGS + 2) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "number of arguments at least 2 and at most %d",
+                        FFI_MAX_ARGS + 2);
+        return 2;
+    }
+
+    // check return-type
+    if ((sig->ret_struct = tostructdef(L, 2))) {
+        sig->ret_type     = T_STRUCT;
+        sig->ret_ffi_type = &sig->ret_struct->type;
+        sig->pushret      = NULL;
+        sym->flags |= SYM_STRUCT;
+    } else {
+        sig->ret_type = check_ffitype(L, 2, &sig->ret_ffi_type);
+        if (!(sig->pushret = PUSHRETS[sig->ret_type])) {
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, "%s cannot be used as return type",
+                            lua_tostring(L, 2));
+            return 2;
+        }
+    }
+    // check function-name
+    name       = luaL_checklstring(L, 3, &len);
+    // check arguments (exclude return type and function name)
+    sig->nargs = 0;
+    for (int i = 4; i <= nargs + 1; i++) {
+        datatype_t t     = T_VOID;
+        structdef_t *def = NULL;
+
+        if (sig->nargs == FFI_MAX_ARGS) {
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, "number of C arguments must be at most %d",
+                            FFI_MAX_ARGS);
+            return 2;
+        }
+        // the variadic function is declared with the trailing '...'
+        if (lua_type(L, i) == LUA_TSTRING &&
+            strcmp(lua_tostring(L, i), "...") == 0) {
+            if (i != nargs + 1) {
+                lua_pushboolean(L, 0);
+                lua_pushliteral(L, "... must be the last argument type");
+                return 2;
+            }
+            sym->flags |= SYM_VARIADIC;
+            break;
+        }
+        if ((def = tostructdef(L, i))) {
+            t                              = T_STRUCT;
+            sig->arg_ffi_types[sig->nargs] = &def->type;
+            sig->arg_bases[sig->nargs]     = T_VOID;
+            sym->flags |= SYM_STRUCT;
+        } else {
+            t = check_argtype(L, i, &sig->arg_ffi_types[sig->nargs],
+                              &sig->arg_bases[sig->nargs]);
+        }
+        // output arguments require the value type
+        if (t == T_VOID ||
+            ((t == T_OUT || t == T_INOUT) &&
+             (sig->arg_bases[sig->nargs] == T_VOID ||
+              sig->arg_bases[sig->nargs] == T_BYTES))) {
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, "%s cannot be used as argument type",
+                            lua_tostring(L, i));
+            return 2;
+        }
+        sig->arg_structs[sig->nargs] = def;
+        sig->arg_types[sig->nargs++] = t;
+        if (t == T_BYTES) {
+            // bytes is passed as the pointer and the length
+            if (sig->nargs == FFI_MAX_ARGS) {
+                lua_pushboolean(L, 0);
+                lua_pushfstring(L, "number of C arguments must be at most %d",
+                                FFI_MAX_ARGS);
+                return 2;
+            }
+            sig->arg_types[sig->nargs]       = T_SIZE_T;
+            sig->arg_bases[sig->nargs]       = T_VOID;
+            sig->arg_structs[sig->nargs]     = NULL;
+            sig->arg_ffi_types[sig->nargs++] = &FFI_TYPE_SIZE_T;
+        }
+    }
+
+    // check the source of the length of the returned string
+    sig->lenout = -1;
+    sym->lensym = NULL;
+    if (check_retlen(L, opts, dso, sym) != 0) {
+        return 2;
+    }
+    return bind_symbol(L, dso, sym, name, len, namebuf);
+}
+
+static int dlsym_lua(lua_State *L)
+{
+    return define_symbol(L, NULL);
+}
+
+// define the symbol of dlsym_many in the protected mode. the upvalue is the
+// address in the nameblock to store the symbol name.
+static int dlsym_entry_lua(lua_State *L)
+{
+    return define_symbol(L, (char *)lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+static int dlsym_many_lua(lua_State *L)
+{
+    dso_t *dso         = checkdso(L, 1);
+    size_t n           = 0;
+    size_t total       = 0;
+    nameblock_t *block = NULL;
+    char *namebuf      = NULL;
+    int nerr           = 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    lua_settop(L, 3);
+    if (!dso->handle) {
+        return luaL_error(L, "module is closed");
+    }
+    luaL_checkstack(L, FFI_MAX_ARGS + LUA_MINSTACK, NULL);
+    n = lua_rawlen(L, 2);
+
+    // allocate the names of all the symbols at once
+    for (size_t i = 1; i <= n; i++) {
+        lua_rawgeti(L, 2, (int)i);
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            return luaL_error(L, "element #%d must be a table of the signature",
+                              (int)i);
+        }
+        lua_rawgeti(L, -1, 2);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "element #%d: function name must be a string",
+                              (int)i);
+        }
+        total += lua_rawlen(L, -1) + 1;
+        lua_pop(L, 2);
+    }
+    if (!(block = malloc(sizeof(nameblock_t) + total))) {
+        return luaL_error(L, "failed to allocate memory for symbol names");
+    }
+    block->next = dso->names;
+    dso->names  = block;
+    namebuf     = block->names;
+
+    // errors
+    lua_newtable(L);
+    for (size_t i = 1; i <= n; i++) {
+        int top     = lua_gettop(L);
+        size_t narg = 0;
+
+        // call dlsym_entry_lua(dso, return_type, function_name, ...)
+        lua_pushlightuserdata(L, namebuf);
+        lua_pushcclosure(L, dlsym_entry_lua, 1);
+        lua_pushvalue(L, 1);
+        lua_rawgeti(L, 2, (int)i);
+        narg = lua_rawlen(L, -1);
+        if (narg > FFI_MAX_ARGS + 3) {
+            lua_pushfstring(L, "number of arguments at least 2 and at most %d",
+                            FFI_MAX_ARGS + 2);
+            lua_rawseti(L, 4, (int)i);
+            lua_settop(L, top);
+            nerr++;
+            continue;
+        }
+        for (size_t k = 1; k <= narg; k++) {
+            lua_rawgeti(L, top + 3, (int)k);
+        }
+        lua_remove(L, top + 3);
+        // use the shared options if the element has no options
+        if (lua_type(L, -1) != LUA_TTABLE && !lua_isnil(L, 3)) {
+            lua_pushvalue(L, 3);
+            narg++;
+        }
+
+        if (lua_pcall(L, (int)narg + 1, 2, 0) != 0) {
+            lua_rawseti(L, 4, (int)i);
+            nerr++;
+        } else if (!lua_toboolean(L, -2)) {
+            lua_rawseti(L, 4, (int)i);
+            nerr++;
+        } else {
+            // the name is stored in the block
+            lua_rawgeti(L, 2, (int)i);
+            lua_rawgeti(L, -1, 2);
+            namebuf += lua_rawlen(L, -1) + 1;
+        }
+        lua_settop(L, top);
+    }
+
+    if (nerr) {
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// the manifest written by dso:dump() holds the signatures of the symbols in
+// the native byte order, so it can be loaded only by the same build of the
+// module. the header is followed by the NUL terminated library path, and the
+// records of the symbols. each field is padded to 4 bytes.
+#define MANIFEST_MAGIC   "DLOPENM"
+#define MANIFEST_VERSION 1
+#define MANIFEST_FLAGS   (SYM_UNCHECKED | SYM_VARIADIC | SYM_ERRNO | SYM_LAZY)
+#define MANIFEST_ALIGN(n) (((n) + 3) & ~(size_t)3)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t ntypes; // T_LAST of the build
+    uint32_t nsyms;
+    uint32_t pathlen;
+} manifest_hdr_t;
+
+// the record is followed by the argument types, the value types of the
+// output arguments, and the NUL terminated symbol name
+typedef struct {
+    uint32_t flags;
+    int32_t lensym; // index of the retlen symbol, or -1
+    int8_t lenarg;  // C argument index of the retlen size_t*, or -1
+    uint8_t ret_type;
+    uint8_t nargs;
+    uint8_t reserved;
+    uint32_t namelen;
+} manifest_sym_t;
+
+static int dump_lua(lua_State *L)
+{
+    dso_t *dso         = checkdso(L, 1);
+    const char *path   = luaL_checkstring(L, 2);
+    manifest_hdr_t hdr = {MANIFEST_MAGIC, MANIFEST_VERSION, T_LAST, 0, 0};
+    static const char PAD[4] = {0};
+    luaL_Buffer b;
+    const char *data = NULL;
+    size_t len       = 0;
+    FILE *fp         = NULL;
+    int err          = 0;
+
+    if (!dso->handle) {
+        return luaL_error(L, "module is closed");
+    }
+    lua_settop(L, 2);
+    hdr.pathlen = (uint32_t)strlen(dso->path);
+    for (syminfo_t *sym = dso->symbols_head; sym; sym = sym->next) {
+        if (sym->flags & SYM_STRUCT) {
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L,
+                            "symbol '%s' with struct values cannot be "
+                            "dumped",
+                            sym->name);
+            return 2;
+        }
+        hdr.nsyms++;
+    }
+
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, (const char *)&hdr, sizeof(hdr));
+    luaL_addlstring(&b, dso->path, hdr.pathlen + 1);
+    luaL_addlstring(&b, PAD, MANIFEST_ALIGN(hdr.pathlen + 1) - hdr.pathlen - 1);
+    for (syminfo_t *sym = dso->symbols_head; sym; sym = sym->next) {
+        signature_t *sig   = sym->sig;
+        manifest_sym_t rec = {
+            .flags    = sym->flags & MANIFEST_FLAGS,
+            .lensym   = -1,
+            .lenarg   = (int8_t)(sig->lenout < 0 ? -1 : sig->outs[sig->lenout]),
+            .ret_type = (uint8_t)sig->ret_type,
+            .nargs    = (uint8_t)sig->nargs,
+            .namelen  = (uint32_t)strlen(sym->name),
+        };
+        size_t reclen = sizeof(rec) + sig->nargs * 2 + rec.namelen + 1;
+
+        if (sym->lensym) {
+            syminfo_t *it = dso->symbols_head;
+
+            for (rec.lensym = 0; it != sym->lensym; rec.lensym++) {
+                it = it->next;
+            }
+        }
+        luaL_addlstring(&b, (const char *)&rec, sizeof(rec));
+        for (size_t i = 0; i < sig->nargs; i++) {
+            luaL_addchar(&b, (char)sig->arg_types[i]);
+        }
+        for (size_t i = 0; i < sig->nargs; i++) {
+            luaL_addchar(&b, (char)sig->arg_bases[i]);
+        }
+        luaL_addlstring(&b, sym->name, rec.namelen + 1);
+        luaL_addlstring(&b, PAD, MANIFEST_ALIGN(reclen) - reclen);
+    }
+    luaL_pushresult(&b);
+    data = lua_tolstring(L, -1, &len);
+
+    // write the manifest
+    if (!(fp = fopen(path, "wb"))) {
+        err = errno;
+    } else if (fwrite(data, 1, len, fp) != len) {
+        err = errno ? errno : EIO;
+        fclose(fp);
+    } else if (fclose(fp) != 0) {
+        err = errno;
+    }
+    if (err) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "failed to write manifest '%s': %s", path,
+                        strerror(err));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// resolve all the lazy symbols, so that the first call of them does not pay
+// the lookup. returns the number of the symbols resolved by this call.
+static int prebind_lua(lua_State *L)
+{
+    dso_t *dso    = checkdso(L, 1);
+    lua_Integer n = 0;
+
+    if (!dso->handle) {
+        return luaL_error(L, "module is closed");
+    }
+    for (syminfo_t *sym = dso->symbols_head; sym; sym = sym->next) {
+        if (sym->addr) {
+            continue;
+        } else if (resolve_symbol(L, dso, sym) != 0) {
+            lua_pushnil(L);
+            lua_insert(L, -2);
+            return 2;
+        }
+        n++;
+    }
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int dso_close(lua_State *L, dso_t *dso)
+{
+    void *handle   = dso->handle;
+    syminfo_t *sym = dso->symbols_head;
+
+    if (handle) {
+        // close module first, so that the symbols remain bound if failed
+        if (dlclose(handle) != 0) {
+            return -1;
+        }
+        dso->handle = NULL;
+
+        // free path
+        free(dso->path);
+        dso->path = NULL;
+
+        // free symbol entry
+        while (sym) {
+            syminfo_t *next = sym->next;
+            if (!(sym->flags & SYM_NAMEBLOCK)) {
+                free(sym->name);
+            }
+            // functions returned by dso:func() may outlive the module
+            sym->addr   = NULL;
+            sym->stub   = NULL;
+            sym->dso    = NULL;
+            release_signature(sym->sig);
+            sym->sig = &SIG_CLOSED;
+            while (sym->varcifs) {
+                varcif_t *vc = sym->varcifs;
+                sym->varcifs = vc->next;
+                free(vc);
+            }
+            luaL_unref(L, LUA_REGISTRYINDEX, sym->ref);
+            sym->ref  = LUA_NOREF;
+            sym->next = NULL;
+            sym       = next;
+        }
+        dso->symbols_head = NULL;
+        dso->symbols_tail = NULL;
+#ifdef DLOPEN_JIT
+        jit_free(dso->jit);
+        dso->jit = NULL;
+#endif
+        while (dso->names) {
+            nameblock_t *block = dso->names;
+            dso->names         = block->next;
+            free(block);
+        }
+    }
+    return 0;
+}
+
+// find the symbol named by the argument at idx from the method table of the
+// dso at index 1, and push its syminfo userdata onto the stack
+static syminfo_t *checksym(lua_State *L, int idx)
+{
+    dso_t *dso       = checkdso(L, 1);
+    const char *name = luaL_checkstring(L, idx);
+    syminfo_t *sym   = NULL;
+
+    // check if module is closed
+    if (!dso->handle) {
+        luaL_error(L, "module is closed");
+    }
+
+    // find the call closure of the symbol
+    lua_getmetatable(L, 1);
+    lua_pushliteral(L, "__index");
+    lua_rawget(L, -2);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    if (lua_tocfunction(L, -1) != symcall_lua) {
+        luaL_error(L, "symbol '%s' is not defined", name);
+    }
+    lua_getupvalue(L, -1, 1);
+    sym = (syminfo_t *)lua_touserdata(L, -1);
+    lua_replace(L, -4);
+    lua_pop(L, 2);
+    return sym;
+}
+
+static int func_lua(lua_State *L)
+{
+    lua_settop(L, 2);
+    checksym(L, 2);
+    // create a function bound to the syminfo that also keeps the dso alive
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, symfunc_lua, 2);
+    return 1;
+}
+
+static int callmany_lua(lua_State *L)
+{
+    syminfo_t *sym = NULL;
+    size_t n       = 0;
+    int base       = 6;
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+    sym = checksym(L, 2);
+    luaL_checkstack(L, (int)sym->sig->nparams + LUA_MINSTACK, NULL);
+    n = lua_rawlen(L, 3);
+    // results
+    lua_createtable(L, (int)n, 0);
+
+    for (size_t i = 1; i <= n; i++) {
+        int nres = 0;
+
+        // push the arguments of the element to the base of the frame
+        lua_rawgeti(L, 3, (int)i);
+        if (lua_type(L, base) == LUA_TTABLE) {
+            for (size_t k = 1; k <= sym->sig->nparams; k++) {
+                lua_rawgeti(L, base, (int)k);
+            }
+            lua_remove(L, base);
+        } else if (sym->sig->nparams != 1) {
+            return luaL_error(L, "element #%d must be a table of arguments",
+                              (int)i);
+        }
+
+        nres = symcall(L, sym, base);
+        if (nres == 1) {
+            lua_rawseti(L, 5, (int)i);
+        } else if (nres > 1) {
+            // multiple results are stored as a table
+            lua_createtable(L, nres, 0);
+            lua_insert(L, -(nres + 1));
+            for (int j = nres; j > 0; j--) {
+                lua_rawseti(L, -(j + 1), j);
+            }
+            lua_rawseti(L, 5, (int)i);
+        }
+        lua_settop(L, 5);
+    }
+    return 1;
+}
+
+static int closed_lua(lua_State *L)
+{
+    return luaL_error(L, "module is closed");
+}
+
+static int dlclose_lua(lua_State *L)
+{
+    dso_t *dso = checkdso(L, 1);
+
+    if (dso_close(L, dso) == 0) {
+        // drop the method table, any further access raises an error
+        lua_getmetatable(L, 1);
+        lua_pushliteral(L, "__index");
+        lua_pushcfunction(L, closed_lua);
+        lua_rawset(L, -3);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    // dlclose failed
+    lua_pushboolean(L, 0);
+    lua_pushfstring(L, "failed to close module: %s", dlerror());
+    return 2;
+}
+
+static int unknown_lua(lua_State *L)
+{
+    // called only if the method table of the dso does not have the field
+    return luaL_error(L, "attempt to index invalid unknown field '%s'",
+                      lua_tostring(L, 2));
+}
+
+static int gc_lua(lua_State *L)
+{
+    dso_t *dso = checkdso(L, 1);
+    dso_close(L, dso);
+    return 0;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    dso_t *dso = checkdso(L, 1);
+    lua_pushfstring(L, "%s: %p (%s)", MODULE_MT, dso->handle, dso->path);
+    return 1;
+}
+
+static const struct luaL_Reg METHODS[] = {
+    {"dlsym",      dlsym_lua     },
+    {"dlsym_many", dlsym_many_lua},
+    {"dump",       dump_lua      },
+    {"prebind",    prebind_lua   },
+    {"dlclose",    dlclose_lua   },
+    {"func",       func_lua      },
+    {"callmany",   callmany_lua  },
+    {NULL,         NULL          }
+};
+
+// returns the mode of dlopen selected by the options table at idx
+static int check_mode(lua_State *L, int idx)
+{
+    int mode = RTLD_NOW | RTLD_LOCAL;
+
+    if (!lua_isnoneornil(L, idx)) {
+        luaL_checktype(L, idx, LUA_TTABLE);
+        mode = optboolean(L, idx, "lazy") ? RTLD_LAZY : RTLD_NOW;
+        mode |= optboolean(L, idx, "global") ? RTLD_GLOBAL : RTLD_LOCAL;
+        if (optboolean(L, idx, "nodelete")) {
+#ifdef RTLD_NODELETE
+            mode |= RTLD_NODELETE;
+#else
+            luaL_argerror(L, idx, "nodelete is not supported");
+#endif
+        }
+    }
+    return mode;
+}
+
+static int new_lua(lua_State *L)
+{
+    size_t len       = 0;
+    const char *path = luaL_checklstring(L, 1, &len);
+    int mode         = check_mode(L, 2);
+    dso_t *dso       = NULL;
+
+    // clear stack except path
+    lua_settop(L, 1);
+
+    // open module
+    dso               = (dso_t *)lua_newuserdata(L, sizeof(dso_t));
+    // initialize fields
+    dso->symbols_head = NULL;
+    dso->symbols_tail = NULL;
+    dso->names        = NULL;
+    dso->jit          = NULL;
+    // duplicate path string
+    if (!(dso->path = strdup(path))) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to allocate memory for path");
+        return 2;
+    }
+    // open shared library
+    if (!(dso->handle = dlopen(path, mode))) {
+        // dlopen failed
+        free(dso->path);
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to open module '%s': %s", path, dlerror());
+        return 2;
+    }
+
+    // create a metatable for this dso from the module metatable
+    lua_createtable(L, 0, 4);
+    luaL_getmetatable(L, MODULE_MT);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -5);
+    }
+    lua_pop(L, 1);
+    // create a method table that holds the methods and the bound symbols
+    lua_createtable(L, 0, 2);
+    for (const struct luaL_Reg *ptr = METHODS; ptr->name; ptr++) {
+        lua_pushcfunction(L, ptr->func);
+        lua_setfield(L, -2, ptr->name);
+    }
+    luaL_getmetatable(L, MODULE_METHODS_MT);
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, "__index");
+    // set metatable
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// returns the record of the symbol at pos and advances pos to the next
+// record, or returns NULL if the record is truncated
+static const manifest_sym_t *manifest_sym(const char *map, size_t size,
+                                          size_t *pos)
+{
+    const manifest_sym_t *rec = (const manifest_sym_t *)(map + *pos);
+    size_t len                = 0;
+
+    if (*pos > size || size - *pos < sizeof(manifest_sym_t)) {
+        return NULL;
+    }
+    len = sizeof(manifest_sym_t) + rec->nargs * 2 + (size_t)rec->namelen + 1;
+    if (rec->namelen > size || size - *pos < len || map[*pos + len - 1]) {
+        return NULL;
+    }
+    *pos += MANIFEST_ALIGN(len);
+    return rec;
+}
+
+// returns non-zero if the record of the symbol at idx is consistent
+static int manifest_sym_valid(const manifest_sym_t *rec, uint32_t idx)
+{
+    const uint8_t *types = (const uint8_t *)(rec + 1);
+    const uint8_t *bases = types + rec->nargs;
+
+    if ((rec->flags & ~(uint32_t)MANIFEST_FLAGS) || rec->nargs > FFI_MAX_ARGS ||
+        rec->ret_type >= T_LAST || !PUSHRETS[rec->ret_type] ||
+        rec->lensym < -1 || rec->lensym >= (int32_t)idx ||
+        rec->lenarg < -1 || rec->lenarg >= (int)rec->nargs ||
+        (rec->lensym >= 0 &&
+         (rec->ret_type != T_CHAR_PTR || (rec->flags & SYM_VARIADIC)))) {
+        return 0;
+    }
+    for (size_t i = 0; i < rec->nargs; i++) {
+        switch (types[i]) {
+        case T_OUT:
+        case T_INOUT:
+            if (bases[i] >= T_LAST || bases[i] == T_VOID ||
+                !PUSHRETS[bases[i]]) {
+                return 0;
+            }
+            break;
+        case T_BYTES:
+            // followed by the length argument
+            if (i + 1 == rec->nargs || types[++i] != T_SIZE_T) {
+                return 0;
+            }
+            break;
+        default:
+            if (types[i] >= T_LAST || types[i] == T_VOID ||
+                !datatype_ffi((datatype_t)types[i])) {
+                return 0;
+            }
+        }
+    }
+    return rec->lenarg < 0 || (rec->ret_type == T_CHAR_PTR &&
+                               (types[rec->lenarg] == T_OUT ||
+                                types[rec->lenarg] == T_INOUT) &&
+                               bases[rec->lenarg] == T_SIZE_T);
+}
+
+// open the library and bind the symbols of the mapped manifest
+static int load_manifest(lua_State *L, const char *map, size_t size)
+{
+    const manifest_hdr_t *hdr = (const manifest_hdr_t *)map;
+    size_t pos                = sizeof(manifest_hdr_t);
+    size_t next               = 0;
+    size_t total              = 0;
+    dso_t *dso                = NULL;
+    syminfo_t **syms          = NULL;
+    nameblock_t *block        = NULL;
+    char *namebuf             = NULL;
+    signature_t buf;
+    signature_t *sig = &buf;
+
+    if (size < sizeof(manifest_hdr_t) ||
+        memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != MANIFEST_VERSION || hdr->ntypes != T_LAST ||
+        hdr->pathlen >= size - pos || map[pos + hdr->pathlen]) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid manifest");
+        return 2;
+    }
+    pos += MANIFEST_ALIGN(hdr->pathlen + 1);
+    // validate all the records before opening the library
+    next = pos;
+    for (uint32_t i = 0; i < hdr->nsyms; i++) {
+        const manifest_sym_t *rec = manifest_sym(map, size, &next);
+
+        if (!rec || !manifest_sym_valid(rec, i)) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "invalid manifest: symbol #%d", (int)i + 1);
+            return 2;
+        }
+        total += rec->namelen + 1;
+    }
+
+    // open the library with the options, and replace the stack with the dso
+    lua_settop(L, 2);
+    lua_pushlstring(L, map + sizeof(manifest_hdr_t), hdr->pathlen);
+    lua_replace(L, 1);
+    if (new_lua(L) != 1) {
+        return 2;
+    }
+    lua_replace(L, 1);
+    dso  = (dso_t *)lua_touserdata(L, 1);
+    syms = (syminfo_t **)lua_newuserdata(L, sizeof(syminfo_t *) * hdr->nsyms);
+    if (!(block = malloc(sizeof(nameblock_t) + total))) {
+        return luaL_error(L, "failed to allocate memory for symbol names");
+    }
+    block->next = dso->names;
+    dso->names  = block;
+    namebuf     = block->names;
+
+    // bind the symbols without parsing the type names
+    for (uint32_t i = 0; i < hdr->nsyms; i++) {
+        const manifest_sym_t *rec = manifest_sym(map, size, &pos);
+        const uint8_t *types      = (const uint8_t *)(rec + 1);
+        const char *name          = (const char *)(types + rec->nargs * 2);
+        syminfo_t *sym            = lua_newuserdata(L, sizeof(syminfo_t));
+
+        // the signature is interned by bind_symbol
+        memset(sig, 0, sizeof(signature_t));
+        sig->ret_type     = (datatype_t)rec->ret_type;
+        sig->ret_ffi_type = datatype_ffi(sig->ret_type);
+        sig->pushret      = PUSHRETS[sig->ret_type];
+        sig->nargs        = rec->nargs;
+        for (size_t k = 0; k < sig->nargs; k++) {
+            sig->arg_types[k] = (datatype_t)types[k];
+            sig->arg_bases[k] = (datatype_t)types[sig->nargs + k];
+            if (sig->arg_types[k] == T_OUT || sig->arg_types[k] == T_INOUT) {
+                sig->arg_ffi_types[k] = &ffi_type_pointer;
+            } else {
+                sig->arg_ffi_types[k] = datatype_ffi(sig->arg_types[k]);
+            }
+        }
+        sig->lenout  = rec->lenarg;
+        sym->flags   = rec->flags;
+        sym->errslot = (sym->flags & SYM_ERRNO) ? errno_slot(L) : NULL;
+        sym->sig     = sig;
+        sym->lensym  = (rec->lensym < 0) ? NULL : syms[rec->lensym];
+        syms[i]      = sym;
+
+        // the pair is checked in the same way as the retlen option of dlsym
+        if (sym->lensym && check_retlen_pair(sig, sym->lensym)) {
+            dso_close(L, dso);
+            lua_pushnil(L);
+            lua_pushfstring(L, "invalid manifest: symbol #%d", (int)i + 1);
+            return 2;
+        }
+        if (bind_symbol(L, dso, sym, name, rec->namelen, namebuf) != 1) {
+            // close the library instead of leaving it to the gc
+            dso_close(L, dso);
+            lua_pushnil(L);
+            lua_pushfstring(L, "failed to load symbol '%s': %s", name,
+                            lua_tostring(L, -2));
+            return 2;
+        }
+        lua_pop(L, 1);
+        namebuf += rec->namelen + 1;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+// load the manifest in the protected mode. the arguments are the path, the
+// options, the address and the pointer to the size of the mapping.
+static int load_manifest_lua(lua_State *L)
+{
+    const char *map = (const char *)lua_touserdata(L, 3);
+    size_t size     = *(size_t *)lua_touserdata(L, 4);
+
+    lua_settop(L, 2);
+    return load_manifest(L, map, size);
+}
+
+static int load_lua(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    int fd           = -1;
+    struct stat st;
+    void *map   = MAP_FAILED;
+    size_t size = 0;
+    int rv      = 0;
+
+    // check the options before mapping the manifest
+    check_mode(L, 2);
+    lua_settop(L, 2);
+    // the manifest is unmapped after the protected call, even if an error is
+    // raised while loading it
+    lua_pushcfunction(L, load_manifest_lua);
+    lua_insert(L, 1);
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1 ||
+        (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                    0)) == MAP_FAILED) {
+        int err = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to open manifest '%s': %s", path,
+                        strerror(err));
+        return 2;
+    }
+    close(fd);
+    size = (size_t)st.st_size;
+    lua_pushlightuserdata(L, map);
+    lua_pushlightuserdata(L, &size);
+    rv = lua_pcall(L, 4, LUA_MULTRET, 0);
+    munmap(map, size);
+    if (rv != 0) {
+        return lua_error(L);
+    }
+    return lua_gettop(L);
+}
+
+static int call_lua(lua_State *L)
+{
+    // exclude module table
+    lua_remove(L, 1);
+    return new_lua(L);
+}
+
+static int tostring_ptr_lua(lua_State *L)
+{
+    const char *ptr = NULL;
+
+    switch (lua_type(L, 1)) {
+    case LUA_TNONE:
+    case LUA_TNIL:
+        lua_pushnil(L);
+        return 1;
+    case LUA_TLIGHTUSERDATA:
+        ptr = (const char *)lua_touserdata(L, 1);
+        break;
+    default:
+        return luaL_argerror(L, 1, "nil or lightuserdata expected");
+    }
+
+    if (lua_isnoneornil(L, 2)) {
+        lua_pushstring(L, ptr);
+    } else {
+        lua_Integer len = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, len >= 0, 2, "length must be non-negative");
+        lua_pushlstring(L, ptr, (size_t)len);
+    }
+    return 1;
+}
+
+static buffer_t *checkbuffer(lua_State *L, int idx)
+{
+    return (buffer_t *)luaL_checkudata(L, idx, BUFFER_MT);
+}
+
+// checks the range of the optional offset and length arguments at idx and
+// idx + 1 against the length of the buffer. the length defaults to the rest
+// of the buffer.
+static void checkrange(lua_State *L, int idx, buffer_t *buf, size_t *off,
+                       size_t *len)
+{
+    lua_Integer o = luaL_optinteger(L, idx, 0);
+    lua_Integer n = 0;
+
+    luaL_argcheck(L, o >= 0 && (size_t)o <= buf->len, idx,
+                  "offset out of range");
+    n = luaL_optinteger(L, idx + 1, (lua_Integer)(buf->len - (size_t)o));
+    luaL_argcheck(L, n >= 0 && (size_t)n <= buf->len - (size_t)o, idx + 1,
+                  "length out of range");
+    *off = (size_t)o;
+    *len = (size_t)n;
+}
+
+// grows the capacity of the buffer to at least n bytes. new bytes are zeroed.
+static int buffer_reserve(buffer_t *buf, size_t n)
+{
+    if (n > buf->cap) {
+        char *data = realloc(buf->data, n);
+        if (!data) {
+            return -1;
+        }
+        memset(data + buf->cap, 0, n - buf->cap);
+        buf->data = data;
+        buf->cap  = n;
+    }
+    return 0;
+}
+
+static int buffer_tostring_lua(lua_State *L)
+{
+    buffer_t *buf = checkbuffer(L, 1);
+    size_t off    = 0;
+    size_t len    = 0;
+
+    checkrange(L, 2, buf, &off, &len);
+    lua_pushlstring(L, buf->data + off, len);
+    return 1;
+}
+
+static int buffer_fill_lua(lua_State *L)
+{
+    buffer_t *buf = checkbuffer(L, 1);
+    lua_Integer c = luaL_optinteger(L, 2, 0);
+    size_t off    = 0;
+    size_t len    = 0;
+
+    luaL_argcheck(L, c >= 0 && c <= 0xff, 2, "byte value out of range");
+    checkrange(L, 3, buf, &off, &len);
+    memset(buf->data + off, (int)c, len);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int buffer_resize_lua(lua_State *L)
+{
+    buffer_t *buf = checkbuffer(L, 1);
+    lua_Integer n = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, n >= 0, 2, "length must be non-negative");
+    // shrinking keeps the capacity for reuse
+    if (buffer_reserve(buf, (size_t)n) != 0) {
+        return luaL_error(L, "failed to resize buffer: out of memory");
+    } else if ((size_t)n > buf->len) {
+        // the bytes left by the previous shrink are zeroed as well
+        memset(buf->data + buf->len, 0, (size_t)n - buf->len);
+    }
+    buf->len = (size_t)n;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int buffer_cap_lua(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)checkbuffer(L, 1)->cap);
+    return 1;
+}
+
+static int buffer_ptr_lua(lua_State *L)
+{
+    buffer_t *buf = checkbuffer(L, 1);
+    size_t off    = 0;
+    size_t len    = 0;
+
+    checkrange(L, 2, buf, &off, &len);
+    lua_pushlightuserdata(L, buf->data + off);
+    return 1;
+}
+
+static int buffer_len_lua(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)checkbuffer(L, 1)->len);
+    return 1;
+}
+
+static int buffer_gc_lua(lua_State *L)
+{
+    buffer_t *buf = checkbuffer(L, 1);
+
+    free(buf->data);
+    buf->data = NULL;
+    buf->len  = 0;
+    buf->cap  = 0;
+    return 0;
+}
+
+static int buffer_tostr_lua(lua_State *L)
+{
+    buffer_t *buf = checkbuffer(L, 1);
+    lua_pushfstring(L, BUFFER_MT ": %p (%d/%d)", buf->data, (int)buf->len,
+                    (int)buf->cap);
+    return 1;
+}
+
+static int buffer_lua(lua_State *L)
+{
+    lua_Integer n = luaL_checkinteger(L, 1);
+    buffer_t *buf = NULL;
+
+    luaL_argcheck(L, n >= 0, 1, "length must be non-negative");
+    buf = (buffer_t *)lua_newuserdata(L, sizeof(buffer_t));
+    *buf = (buffer_t){0};
+    luaL_getmetatable(L, BUFFER_MT);
+    lua_setmetatable(L, -2);
+    // allocate at least one byte so that the buffer never passes NULL
+    if (buffer_reserve(buf, n ? (size_t)n : 1) != 0) {
+        return luaL_error(L, "failed to create buffer: out of memory");
+    }
+    buf->len = (size_t)n;
+    return 1;
+}
+
+static array_t *checkarray(lua_State *L, int idx)
+{
+    return (array_t *)luaL_checkudata(L, idx, ARRAY_MT);
+}
+
+// converts the value on the top of the stack to the element at index i
+static inline lua_Integer toelem_integer(lua_State *L, size_t i)
+{
+    lua_Integer v = 0;
+
+    if (lua_type(L, -1) != LUA_TNUMBER) {
+        luaL_error(L, "element #%d must be a number, got %s", (int)i,
+                   luaL_typename(L, -1));
+    } else if (!tointeger(L, -1, &v)) {
+        luaL_error(L, "element #%d must be an integer", (int)i);
+    }
+    return v;
+}
+
+static inline lua_Number toelem_number(lua_State *L, size_t i)
+{
+    if (lua_type(L, -1) != LUA_TNUMBER) {
+        luaL_error(L, "element #%d must be a number, got %s", (int)i,
+                   luaL_typename(L, -1));
+    }
+    return lua_tonumber(L, -1);
+}
+
+// checks the element offset at idx and returns it
+static size_t checkoffset(lua_State *L, int idx, array_t *arr)
+{
+    lua_Integer off = luaL_optinteger(L, idx, 0);
+
+    luaL_argcheck(L, off >= 0 && (size_t)off <= arr->len, idx,
+                  "offset out of range");
+    return (size_t)off;
+}
+
+static int array_fromtable_lua(lua_State *L)
+{
+    array_t *arr = checkarray(L, 1);
+    size_t off   = checkoffset(L, 3, arr);
+    size_t n     = 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_rawlen(L, 2);
+    luaL_argcheck(L, n <= arr->len - off, 2, "too many elements");
+
+    // copy the elements in a tight loop per element type
+    switch (arr->type) {
+    default:
+        break;
+#define FROMTABLE_CASE(TYPE_ENUM, CTYPE, KIND)                                 \
+    case TYPE_ENUM: {                                                          \
+        CTYPE *elms = (CTYPE *)arr->data + off;                                \
+        for (size_t i = 0; i < n; i++) {                                       \
+            lua_rawgeti(L, 2, (int)(i + 1));                                   \
+            elms[i] = (CTYPE)toelem_##KIND(L, i + 1);                          \
+            lua_pop(L, 1);                                                     \
+        }                                                                      \
+    } break;
+
+        NUMERIC_TYPES(FROMTABLE_CASE)
+#undef FROMTABLE_CASE
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int array_totable_lua(lua_State *L)
+{
+    array_t *arr  = checkarray(L, 1);
+    size_t off    = checkoffset(L, 2, arr);
+    lua_Integer n = luaL_optinteger(L, 3, (lua_Integer)(arr->len - off));
+
+    luaL_argcheck(L, n >= 0 && (size_t)n <= arr->len - off, 3,
+                  "length out of range");
+    lua_createtable(L, (int)n, 0);
+
+    switch (arr->type) {
+    default:
+        break;
+#define TOTABLE_CASE(TYPE_ENUM, CTYPE, KIND)                                   \
+    case TYPE_ENUM: {                                                          \
+        CTYPE *elms = (CTYPE *)arr->data + off;                                \
+        for (size_t i = 0; i < (size_t)n; i++) {                               \
+            pushelem_##KIND(L, elms[i]);                                       \
+            lua_rawseti(L, -2, (int)(i + 1));                                  \
+        }                                                                      \
+    } break;
+
+        NUMERIC_TYPES(TOTABLE_CASE)
+#undef TOTABLE_CASE
+    }
+    return 1;
+}
+
+static int array_ptr_lua(lua_State *L)
+{
+    array_t *arr = checkarray(L, 1);
+    size_t off   = checkoffset(L, 2, arr);
+
+    lua_pushlightuserdata(L, (char *)arr->data + off * arr->size);
+    return 1;
+}
+
+static int array_len_lua(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)checkarray(L, 1)->len);
+    return 1;
+}
+
+static int array_tostr_lua(lua_State *L)
+{
+    array_t *arr = checkarray(L, 1);
+    lua_pushfstring(L, ARRAY_MT ": %p (%d)", (void *)arr->data,
+                    (int)arr->len);
+    return 1;
+}
+
+static int array_lua(lua_State *L)
+{
+    ffi_type *ftype = NULL;
+    datatype_t type = check_ffitype(L, 1, &ftype);
+    lua_Integer n   = luaL_checkinteger(L, 2);
+    array_t *arr    = NULL;
+    size_t size     = 0;
+
+    switch (type) {
+    default:
+        return luaL_argerror(L, 1, "unsupported element type");
+#define ARRAY_CASE(TYPE_ENUM, CTYPE, KIND) case TYPE_ENUM:
+        NUMERIC_TYPES(ARRAY_CASE)
+#undef ARRAY_CASE
+        break;
+    }
+    luaL_argcheck(L,
+                  n >= 0 && (size_t)n <= (SIZE_MAX - sizeof(array_t)) /
+                                             ftype->size,
+                  2, "length out of range");
+
+    size = sizeof(array_t) + ftype->size * (size_t)n;
+    arr  = (array_t *)lua_newuserdata(L, size);
+    memset(arr, 0, size);
+    arr->type = type;
+    arr->size = ftype->size;
+    arr->len  = (size_t)n;
+    luaL_getmetatable(L, ARRAY_MT);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static structdef_t *checkstructdef(lua_State *L, int idx)
+{
+    return (structdef_t *)luaL_checkudata(L, idx, STRUCT_MT);
+}
+
+static int structdef_size_lua(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)checkstructdef(L, 1)->type.size);
+    return 1;
+}
+
+static int structdef_offset_lua(lua_State *L)
+{
+    structdef_t *def = checkstructdef(L, 1);
+    const char *name = luaL_checkstring(L, 2);
 
-    // open module
-    dso               = (dso_t *)lua_newuserdata(L, sizeof(dso_t));
-    // initialize fields
-    dso->symbols_head = NULL;
-    dso->symbols_tail = NULL;
-    // duplicate path string
-    if (!(dso->path = strdup(path))) {
-        lua_pushnil(L);
-        lua_pushfstring(L, "failed to allocate memory for path");
-        return 2;
+    for (size_t i = 0; i < def->nfields; i++) {
+        if (strcmp(def->fields[i].name, name) == 0) {
+            lua_pushinteger(L, (lua_Integer)def->fields[i].offset);
+            return 1;
+        }
     }
-    // open shared library
-    if (!(dso->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
-        // dlopen failed
-        free(dso->path);
-        lua_pushnil(L);
-        lua_pushfstring(L, "failed to open module '%s': %s", path, dlerror());
-        return 2;
+    return luaL_argerror(L, 2, "unknown field");
+}
+
+static int structdef_tostring_lua(lua_State *L)
+{
+    structdef_t *def = checkstructdef(L, 1);
+    lua_pushfstring(L, STRUCT_MT ": %s (%d)", def->name, (int)def->type.size);
+    return 1;
+}
+
+static int defstruct_lua(lua_State *L)
+{
+    size_t len       = 0;
+    const char *name = luaL_checklstring(L, 1, &len);
+    size_t nfields   = 0;
+    size_t namelen   = len + 1;
+    size_t size      = 0;
+    size_t offset    = 0;
+    size_t align     = 1;
+    structdef_t *def = NULL;
+    ffi_type **elms  = NULL;
+    char *names      = NULL;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    luaL_argcheck(L,
+                  len && find_type(name, len) < 0 && name[len - 1] != '*' &&
+                      name[len - 1] != '&',
+                  1, "invalid struct name");
+    if (tostructdef(L, 1)) {
+        return luaL_error(L, "struct '%s' is already defined", name);
     }
 
-    // set metatable
-    luaL_getmetatable(L, MODULE_MT);
+    // check the field declarations 'name@type'
+    nfields = lua_rawlen(L, 2);
+    luaL_argcheck(L, nfields > 0, 2, "struct must have at least one field");
+    for (size_t i = 1; i <= nfields; i++) {
+        const char *decl = NULL;
+
+        lua_rawgeti(L, 2, (int)i);
+        decl = lua_tolstring(L, -1, &len);
+        if (!decl || !strchr(decl, '@') || *decl == '@') {
+            return luaL_error(L, "field #%d must be 'name@type'", (int)i);
+        }
+        namelen += len + 1;
+        lua_pop(L, 1);
+    }
+
+    size = sizeof(structdef_t) + sizeof(structfield_t) * nfields +
+           sizeof(ffi_type *) * (nfields + 1) + namelen;
+    def  = (structdef_t *)lua_newuserdata(L, size);
+    memset(def, 0, size);
+    elms  = (ffi_type **)(def->fields + nfields);
+    names = (char *)(elms + nfields + 1);
+
+    // compute the layout with the alignment of each field
+    for (size_t i = 0; i < nfields; i++) {
+        structfield_t *field = &def->fields[i];
+        const char *decl     = NULL;
+        const char *at       = NULL;
+        int t                = 0;
+
+        lua_rawgeti(L, 2, (int)(i + 1));
+        decl = lua_tolstring(L, -1, &len);
+        at   = strchr(decl, '@');
+        if ((t = find_type(at + 1, len - (size_t)(at + 1 - decl))) >= 0) {
+            field->type = (datatype_t)t;
+            switch (field->type) {
+            case T_VOID:
+            case T_BYTES:
+                return luaL_error(L, "field #%d: %s cannot be used as type",
+                                  (int)(i + 1), at + 1);
+            default:
+                lua_pushstring(L, at + 1);
+                check_ffitype(L, lua_gettop(L), &elms[i]);
+                lua_pop(L, 1);
+            }
+        } else {
+            lua_pushstring(L, at + 1);
+            field->def = tostructdef(L, lua_gettop(L));
+            lua_pop(L, 1);
+            if (!field->def) {
+                return luaL_error(L, "field #%d: unknown type '%s'",
+                                  (int)(i + 1), at + 1);
+            }
+            field->type = T_STRUCT;
+            elms[i]     = &field->def->type;
+        }
+        // copy the field name
+        memcpy(names, decl, (size_t)(at - decl));
+        field->name = names;
+        names += (size_t)(at - decl) + 1;
+        lua_pop(L, 1);
+
+        offset        = (offset + elms[i]->alignment - 1) &
+                        ~(size_t)(elms[i]->alignment - 1);
+        field->offset = offset;
+        offset += elms[i]->size;
+        if (elms[i]->alignment > align) {
+            align = elms[i]->alignment;
+        }
+    }
+    memcpy(names, lua_tostring(L, 1), lua_rawlen(L, 1));
+    def->name           = names;
+    def->nfields        = nfields;
+    def->type.size      = (offset + align - 1) & ~(align - 1);
+    def->type.alignment = (unsigned short)align;
+    def->type.type      = FFI_TYPE_STRUCT;
+    def->type.elements  = elms;
+
+    luaL_getmetatable(L, STRUCT_MT);
+    lua_setmetatable(L, -2);
+    // register the struct type. it is kept alive until the state is closed
+    // since the symbols refer to the type.
+    lua_getfield(L, LUA_REGISTRYINDEX, STRUCT_TYPES);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return 1;
+}
+
+// returns the address of the memory at idx. len receives the size of the
+// memory, or SIZE_MAX if the size is unknown.
+static char *checkaddress(lua_State *L, int idx, size_t *len)
+{
+    char *p = NULL;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TLIGHTUSERDATA:
+        p    = (char *)lua_touserdata(L, idx);
+        *len = SIZE_MAX;
+        break;
+    case LUA_TUSERDATA:
+        if (!(p = (char *)tomemory(L, idx, len))) {
+            p    = (char *)lua_touserdata(L, idx);
+            *len = lua_rawlen(L, idx);
+        }
+        break;
+    default:
+        luaL_argerror(L, idx, "lightuserdata or userdata expected");
+    }
+    luaL_argcheck(L, p != NULL, idx, "NULL pointer");
+    return p;
+}
+
+// check the type of the value in the memory at idx, and returns the size of
+// the value in bytes
+static datatype_t checkmemtype(lua_State *L, int idx, size_t *size,
+                               structdef_t **def)
+{
+    ffi_type *ftype = NULL;
+    datatype_t type = T_STRUCT;
+
+    if ((*def = tostructdef(L, idx))) {
+        *size = (*def)->type.size;
+        return type;
+    }
+    switch ((type = check_ffitype(L, idx, &ftype))) {
+    case T_VOID:
+    case T_BYTES:
+        luaL_argerror(L, idx, "unsupported type");
+    default:
+        *size = ftype->size;
+        return type;
+    }
+}
+
+// check the range of count values from the offset at idx against the size of
+// the memory, and returns the address of the first value
+static char *checkmemrange(lua_State *L, int idx, char *p, size_t len,
+                           size_t size, size_t count)
+{
+    lua_Integer off = luaL_checkinteger(L, idx);
+
+    luaL_argcheck(L, off >= 0, idx, "offset must be non-negative");
+    if (len != SIZE_MAX &&
+        ((size_t)off > len || count > (len - (size_t)off) / size)) {
+        luaL_argerror(L, idx, "out of range");
+    }
+    return p + off;
+}
+
+// writes the value at idx into the memory
+static inline lua_Integer writemem_integer(lua_State *L, int idx,
+                                           datatype_t type)
+{
+    lua_Integer v = 0;
+
+    if (!tointeger(L, idx, &v)) {
+        luaL_error(L, "%s requires an integer", TYPE_NAMES[type]);
+    }
+    return v;
+}
+
+#define writemem_number(L, idx, type) lua_tonumber(L, idx)
+
+static void writemem(lua_State *L, int idx, datatype_t type, structdef_t *def,
+                     char *p)
+{
+    size_t len = 0;
+
+    switch (type) {
+    default:
+        break;
+    case T_STRUCT:
+        tostruct(L, idx, idx, def, p);
+        return;
+    case T_VOID_PTR:
+        switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            *(void **)p = NULL;
+            return;
+        case LUA_TLIGHTUSERDATA:
+            *(void **)p = lua_touserdata(L, idx);
+            return;
+        case LUA_TUSERDATA:
+            if (!(*(void **)p = tomemory(L, idx, &len))) {
+                *(void **)p = lua_touserdata(L, idx);
+            }
+            return;
+        }
+        luaL_error(L, "void* requires nil, lightuserdata or userdata, got %s",
+                   luaL_typename(L, idx));
+        return;
+    case T_CHAR_PTR:
+        // the Lua string cannot be referred after the call
+        luaL_error(L, "char* cannot be written");
+        return;
+    }
+
+    if (lua_type(L, idx) != LUA_TNUMBER) {
+        luaL_error(L, "%s requires number, got %s", TYPE_NAMES[type],
+                   luaL_typename(L, idx));
+    }
+    switch (type) {
+    default:
+        break;
+#define WRITEMEM_CASE(TYPE_ENUM, CTYPE, KIND)                                  \
+    case TYPE_ENUM:                                                            \
+        *(CTYPE *)p = (CTYPE)writemem_##KIND(L, idx, type);                    \
+        break;
+
+        NUMERIC_TYPES(WRITEMEM_CASE)
+#undef WRITEMEM_CASE
+    }
+}
+
+static int read_lua(lua_State *L)
+{
+    size_t len       = 0;
+    char *p          = checkaddress(L, 1, &len);
+    size_t size      = 0;
+    structdef_t *def = NULL;
+    datatype_t type  = checkmemtype(L, 2, &size, &def);
+    lua_Integer n    = 0;
+
+    if (lua_isnoneornil(L, 4)) {
+        // read a value
+        p = checkmemrange(L, 3, p, len, size, 1);
+        pushmem(L, type, def, p);
+        return 1;
+    }
+
+    // read n values into a table
+    n = luaL_checkinteger(L, 4);
+    luaL_argcheck(L, n >= 0, 4, "count must be non-negative");
+    p = checkmemrange(L, 3, p, len, size, (size_t)n);
+    lua_createtable(L, (int)n, 0);
+    for (lua_Integer i = 0; i < n; i++) {
+        pushmem(L, type, def, p);
+        lua_rawseti(L, -2, (int)(i + 1));
+        p += size;
+    }
+    return 1;
+}
+
+static int write_lua(lua_State *L)
+{
+    size_t len       = 0;
+    char *p          = checkaddress(L, 1, &len);
+    size_t size      = 0;
+    structdef_t *def = NULL;
+    datatype_t type  = checkmemtype(L, 2, &size, &def);
+    size_t n         = 0;
+
+    luaL_checkany(L, 4);
+    lua_settop(L, 4);
+    if (type == T_STRUCT || lua_type(L, 4) != LUA_TTABLE) {
+        // write a value
+        p = checkmemrange(L, 3, p, len, size, 1);
+        writemem(L, 4, type, def, p);
+        return 0;
+    }
+
+    // write the elements of the table
+    n = lua_rawlen(L, 4);
+    p = checkmemrange(L, 3, p, len, size, n);
+    for (size_t i = 1; i <= n; i++) {
+        lua_rawgeti(L, 4, (int)i);
+        writemem(L, 5, type, def, p);
+        lua_pop(L, 1);
+        p += size;
+    }
+    return 0;
+}
+
+#if FFI_CLOSURES
+
+// stores the return value of the callback. the integer value narrower than
+// ffi_arg must be widened to the whole ffi_arg.
+# define RETVAL_integer(CTYPE, ret, val)                                       \
+     do {                                                                      \
+         if (sizeof(CTYPE) < sizeof(ffi_arg)) {                                \
+             *(ffi_sarg *)(ret) = (ffi_sarg)(*(CTYPE *)(val));                 \
+         } else {                                                              \
+             *(CTYPE *)(ret) = *(CTYPE *)(val);                                \
+         }                                                                     \
+     } while (0)
+# define RETVAL_number(CTYPE, ret, val) *(CTYPE *)(ret) = *(CTYPE *)(val)
+
+// arguments of the callback passed to callback_call_lua
+typedef struct {
+    callback_t *cb;
+    void *ret;
+    void **args;
+} cbcall_t;
+
+// calls the Lua function of the callback in protected mode, so that any
+// error is not propagated through the frames of the C functions
+static int callback_call_lua(lua_State *L)
+{
+    cbcall_t *call = (cbcall_t *)lua_touserdata(L, 1);
+    callback_t *cb = call->cb;
+    void *ret      = call->ret;
+    callval_u val;
+
+    luaL_checkstack(L, (int)cb->nargs + 1, NULL);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb->ref);
+    for (size_t i = 0; i < cb->nargs; i++) {
+        if (cb->arg_structs[i]) {
+            pushstruct(L, cb->arg_structs[i], call->args[i]);
+        } else {
+            cb->pushargs[i](L, (callval_u *)call->args[i]);
+        }
+    }
+    lua_call(L, (int)cb->nargs, cb->ret_type == T_VOID ? 0 : 1);
+
+    switch (cb->ret_type) {
+    case T_VOID:
+        break;
+    case T_STRUCT:
+        tostruct(L, lua_gettop(L), 0, cb->ret_struct, ret);
+        break;
+    case T_VOID_PTR:
+        cb->toret(L, lua_gettop(L), 0, &val);
+        *(void **)ret = val.p;
+        break;
+    default:
+        cb->toret(L, lua_gettop(L), 0, &val);
+        switch (cb->ret_type) {
+        default:
+            break;
+# define RETVAL_CASE(TYPE_ENUM, CTYPE, KIND)                                   \
+     case TYPE_ENUM:                                                           \
+         RETVAL_##KIND(CTYPE, ret, &val);                                      \
+         break;
+
+            NUMERIC_TYPES(RETVAL_CASE)
+# undef RETVAL_CASE
+        }
+    }
+    return 0;
+}
+
+// called by the C function through the closure. the Lua function runs on
+// the thread that is calling the C function, or on the main thread if the
+// callback is called outside a call.
+static void callback_handler(ffi_cif *cif, void *ret, void **args, void *data)
+{
+    callback_t *cb   = (callback_t *)data;
+    caller_t *caller = cb->caller;
+    lua_State *L     = caller->thread ? caller->thread : caller->main;
+    cbcall_t call    = {cb, ret, args};
+    int top          = lua_gettop(L);
+
+    if (!lua_checkstack(L, 2)) {
+        fprintf(stderr, "dlopen: error in callback: stack overflow\n");
+    } else {
+        lua_pushcfunction(L, callback_call_lua);
+        lua_pushlightuserdata(L, &call);
+        if (lua_pcall(L, 1, 0, 0) == 0) {
+            return;
+        } else if (!caller->thread) {
+            // the error cannot be raised outside a call
+            const char *msg = lua_tostring(L, -1);
+            fprintf(stderr, "dlopen: error in callback: %s\n",
+                    msg ? msg : "(error object is not a string)");
+        } else if (caller->err == LUA_NOREF) {
+            // raised after the C function returns
+            caller->err = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    }
+    if (cb->ret_type != T_VOID) {
+        memset(ret, 0,
+               (cif->rtype->size < sizeof(ffi_arg)) ? sizeof(ffi_arg)
+                                                    : cif->rtype->size);
+    }
+    lua_settop(L, top);
+}
+
+# undef RETVAL_number
+# undef RETVAL_integer
+
+static int callback_gc_lua(lua_State *L)
+{
+    callback_t *cb = (callback_t *)luaL_checkudata(L, 1, CALLBACK_MT);
+
+    if (cb->closure) {
+        ffi_closure_free(cb->closure);
+        cb->closure = NULL;
+        cb->code    = NULL;
+        luaL_unref(L, LUA_REGISTRYINDEX, cb->ref);
+    }
+    return 0;
+}
+
+static int callback_tostring_lua(lua_State *L)
+{
+    callback_t *cb = (callback_t *)luaL_checkudata(L, 1, CALLBACK_MT);
+    lua_pushfstring(L, CALLBACK_MT ": %p", cb->code);
+    return 1;
+}
+
+// check the type of the value passed to the callback at idx
+static datatype_t check_cbtype(lua_State *L, int idx, ffi_type **ffi_type_out,
+                               structdef_t **def)
+{
+    datatype_t type = T_STRUCT;
+
+    if ((*def = tostructdef(L, idx))) {
+        *ffi_type_out = &(*def)->type;
+        return type;
+    }
+    type = check_ffitype(L, idx, ffi_type_out);
+    if (type == T_BYTES) {
+        luaL_argerror(L, idx, "bytes cannot be used for callback");
+    }
+    return type;
+}
+
+static int callback_lua(lua_State *L)
+{
+    int nargs      = lua_gettop(L) - 2;
+    callback_t *cb = NULL;
+    ffi_status st  = FFI_OK;
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    luaL_argcheck(L, nargs <= FFI_MAX_ARGS, FFI_MAX_ARGS + 3,
+                  "too many arguments");
+    cb = (callback_t *)lua_newuserdata(L, sizeof(callback_t));
+    memset(cb, 0, sizeof(callback_t));
+    cb->caller = caller_slot(L);
+
+    // compile the marshaling plan
+    cb->ret_type = check_cbtype(L, 2, &cb->ret_ffi_type, &cb->ret_struct);
+    cb->toret    = TOARGS[cb->ret_type];
+    // the returned Lua string cannot be referred after the callback returns
+    luaL_argcheck(L, cb->ret_type != T_CHAR_PTR, 2,
+                  "char* cannot be used as return type");
+    for (int i = 0; i < nargs; i++) {
+        datatype_t t = check_cbtype(L, i + 3, &cb->arg_ffi_types[i],
+                                    &cb->arg_structs[i]);
+        if (t == T_VOID) {
+            return luaL_argerror(L, i + 3, "void cannot be used as argument");
+        }
+        cb->pushargs[i] = PUSHRETS[t];
+    }
+    cb->nargs = (size_t)nargs;
+
+    st = ffi_prep_cif(&cb->cif, FFI_DEFAULT_ABI, (unsigned int)nargs,
+                      cb->ret_ffi_type, cb->arg_ffi_types);
+    if (st != FFI_OK) {
+        return luaL_error(L, "failed to prepare FFI call interface (%s)",
+                          ffi_status_message(st));
+    }
+    if (!(cb->closure = ffi_closure_alloc(sizeof(ffi_closure), &cb->code))) {
+        return luaL_error(L, "failed to allocate closure");
+    }
+    st = ffi_prep_closure_loc((ffi_closure *)cb->closure, &cb->cif,
+                              callback_handler, cb, cb->code);
+    if (st != FFI_OK) {
+        ffi_closure_free(cb->closure);
+        cb->closure = NULL;
+        return luaL_error(L, "failed to prepare closure (%s)",
+                          ffi_status_message(st));
+    }
+
+    // keep the Lua function alive while the callback is alive
+    lua_pushvalue(L, 1);
+    cb->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaL_getmetatable(L, CALLBACK_MT);
     lua_setmetatable(L, -2);
     return 1;
 }
 
+#else
+
+static int callback_lua(lua_State *L)
+{
+    return luaL_error(L, "callback is not supported on this platform");
+}
+
+#endif
+
+// comparators for qsort, bsearch and the like. they are called from C without
+// entering the Lua VM.
+typedef int (*comparator_t)(const void *, const void *);
+
+#define CMP_FUNC(NAME, CTYPE)                                                  \
+    static int cmp_##NAME(const void *a, const void *b)                        \
+    {                                                                          \
+        CTYPE x = *(const CTYPE *)a;                                           \
+        CTYPE y = *(const CTYPE *)b;                                           \
+        return (x > y) - (x < y);                                              \
+    }                                                                          \
+    static int cmp_##NAME##_desc(const void *a, const void *b)                 \
+    {                                                                          \
+        return cmp_##NAME(b, a);                                               \
+    }
+
+CMP_FUNC(void_ptr, uintptr_t)
+CMP_FUNC(char, char)
+CMP_FUNC(schar, signed char)
+CMP_FUNC(uchar, unsigned char)
+CMP_FUNC(short, short)
+CMP_FUNC(ushort, unsigned short)
+CMP_FUNC(int8, int8_t)
+CMP_FUNC(uint8, uint8_t)
+CMP_FUNC(int16, int16_t)
+CMP_FUNC(uint16, uint16_t)
+CMP_FUNC(int, int)
+CMP_FUNC(uint, unsigned int)
+CMP_FUNC(int32, int32_t)
+CMP_FUNC(uint32, uint32_t)
+CMP_FUNC(int64, int64_t)
+CMP_FUNC(uint64, uint64_t)
+CMP_FUNC(long, long)
+CMP_FUNC(ulong, unsigned long)
+CMP_FUNC(long_long, long long)
+CMP_FUNC(ulong_long, unsigned long long)
+CMP_FUNC(float, float)
+CMP_FUNC(double, double)
+CMP_FUNC(size_t, size_t)
+CMP_FUNC(ssize_t, ssize_t)
+#undef CMP_FUNC
+
+// compares the elements of char*
+static int cmp_char_ptr(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cmp_char_ptr_desc(const void *a, const void *b)
+{
+    return cmp_char_ptr(b, a);
+}
+
+// ascending and descending comparators of the elements of each type
+static const comparator_t COMPARATORS[T_LAST][2] = {
+    [T_VOID_PTR]   = {cmp_void_ptr, cmp_void_ptr_desc},
+    [T_CHAR_PTR]   = {cmp_char_ptr, cmp_char_ptr_desc},
+    [T_CHAR]       = {cmp_char, cmp_char_desc},
+    [T_SCHAR]      = {cmp_schar, cmp_schar_desc},
+    [T_UCHAR]      = {cmp_uchar, cmp_uchar_desc},
+    [T_SHORT]      = {cmp_short, cmp_short_desc},
+    [T_USHORT]     = {cmp_ushort, cmp_ushort_desc},
+    [T_INT8]       = {cmp_int8, cmp_int8_desc},
+    [T_UINT8]      = {cmp_uint8, cmp_uint8_desc},
+    [T_INT16]      = {cmp_int16, cmp_int16_desc},
+    [T_UINT16]     = {cmp_uint16, cmp_uint16_desc},
+    [T_INT]        = {cmp_int, cmp_int_desc},
+    [T_UINT]       = {cmp_uint, cmp_uint_desc},
+    [T_INT32]      = {cmp_int32, cmp_int32_desc},
+    [T_UINT32]     = {cmp_uint32, cmp_uint32_desc},
+    [T_INT64]      = {cmp_int64, cmp_int64_desc},
+    [T_UINT64]     = {cmp_uint64, cmp_uint64_desc},
+    [T_LONG]       = {cmp_long, cmp_long_desc},
+    [T_ULONG]      = {cmp_ulong, cmp_ulong_desc},
+    [T_LONG_LONG]  = {cmp_long_long, cmp_long_long_desc},
+    [T_ULONG_LONG] = {cmp_ulong_long, cmp_ulong_long_desc},
+    [T_FLOAT]      = {cmp_float, cmp_float_desc},
+    [T_DOUBLE]     = {cmp_double, cmp_double_desc},
+    [T_SIZE_T]     = {cmp_size_t, cmp_size_t_desc},
+    [T_SSIZE_T]    = {cmp_ssize_t, cmp_ssize_t_desc},
+};
+
+static int comparator_lua(lua_State *L)
+{
+    ffi_type *ftype = NULL;
+    datatype_t type = check_ffitype(L, 1, &ftype);
+    int desc        = lua_toboolean(L, 2);
+
+    if (!COMPARATORS[type][0]) {
+        return luaL_argerror(L, 1, "unsupported type");
+    }
+    lua_pushlightuserdata(L, (void *)COMPARATORS[type][desc ? 1 : 0]);
+    return 1;
+}
+
+// returns the errno captured by the last call of the symbol declared with the
+// errno option
+static int errno_lua(lua_State *L)
+{
+    lua_pushinteger(L, *errno_slot(L));
+    return 1;
+}
+
 LUALIB_API int luaopen_dlopen(lua_State *L)
 {
     // create metatable
@@ -625,7 +4139,6 @@ LUALIB_API int luaopen_dlopen(lua_State *L)
         struct luaL_Reg mmethod[] = {
             {"__gc",       gc_lua      },
             {"__tostring", tostring_lua},
-            {"__index",    index_lua   },
             {NULL,         NULL        }
         };
 
@@ -640,7 +4153,166 @@ LUALIB_API int luaopen_dlopen(lua_State *L)
 
         lua_pop(L, 1);
     }
+    // create metatable for the method tables
+    if (luaL_newmetatable(L, MODULE_METHODS_MT)) {
+        lua_pushcfunction(L, unknown_lua);
+        lua_setfield(L, -2, "__index");
+        lua_pop(L, 1);
+    }
+    // create metatable for the buffers
+    if (luaL_newmetatable(L, BUFFER_MT)) {
+        struct luaL_Reg mmethod[] = {
+            {"__gc",       buffer_gc_lua    },
+            {"__len",      buffer_len_lua   },
+            {"__tostring", buffer_tostr_lua },
+            {NULL,         NULL             }
+        };
+        struct luaL_Reg method[] = {
+            {"tostring", buffer_tostring_lua},
+            {"fill",     buffer_fill_lua    },
+            {"resize",   buffer_resize_lua  },
+            {"cap",      buffer_cap_lua     },
+            {"ptr",      buffer_ptr_lua     },
+            {NULL,       NULL               }
+        };
+
+        for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+            lua_pushcfunction(L, ptr->func);
+            lua_setfield(L, -2, ptr->name);
+        }
+        lua_createtable(L, 0, 5);
+        for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+            lua_pushcfunction(L, ptr->func);
+            lua_setfield(L, -2, ptr->name);
+        }
+        lua_setfield(L, -2, "__index");
+        lua_pop(L, 1);
+    }
+    // create metatable for the struct types
+    if (luaL_newmetatable(L, STRUCT_MT)) {
+        struct luaL_Reg method[] = {
+            {"size",   structdef_size_lua  },
+            {"offset", structdef_offset_lua},
+            {NULL,     NULL                }
+        };
+
+        lua_pushcfunction(L, structdef_tostring_lua);
+        lua_setfield(L, -2, "__tostring");
+        lua_createtable(L, 0, 2);
+        for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+            lua_pushcfunction(L, ptr->func);
+            lua_setfield(L, -2, ptr->name);
+        }
+        lua_setfield(L, -2, "__index");
+        lua_pop(L, 1);
+    }
+    // create table of the defined struct types
+    lua_getfield(L, LUA_REGISTRYINDEX, STRUCT_TYPES);
+    if (lua_isnil(L, -1)) {
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, STRUCT_TYPES);
+    }
+    lua_pop(L, 1);
+    // create the slot of the captured errno. it is never replaced, since the
+    // symbols keep the address of it.
+    lua_getfield(L, LUA_REGISTRYINDEX, ERRNO_SLOT);
+    if (lua_isnil(L, -1)) {
+        *(int *)lua_newuserdata(L, sizeof(int)) = 0;
+        lua_setfield(L, LUA_REGISTRYINDEX, ERRNO_SLOT);
+    }
+    lua_pop(L, 1);
+    // create the slot of the calling thread in the same way
+    lua_getfield(L, LUA_REGISTRYINDEX, CALLER_SLOT);
+    if (lua_isnil(L, -1)) {
+        caller_t *slot = lua_newuserdata(L, sizeof(caller_t));
+
+        slot->thread = NULL;
+        slot->err    = LUA_NOREF;
+        lua_setfield(L, LUA_REGISTRYINDEX, CALLER_SLOT);
+#if LUA_VERSION_NUM >= 502
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+        // the main thread cannot be found from the other threads, use a new
+        // thread instead if this is not the main thread
+        if (!lua_pushthread(L)) {
+            lua_pop(L, 1);
+            lua_newthread(L);
+        }
+#endif
+        slot->main = lua_tothread(L, -1);
+        // keep the thread alive
+        luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
+#if FFI_CLOSURES
+    // create metatable for the callbacks
+    if (luaL_newmetatable(L, CALLBACK_MT)) {
+        struct luaL_Reg mmethod[] = {
+            {"__gc",       callback_gc_lua      },
+            {"__tostring", callback_tostring_lua},
+            {NULL,         NULL                 }
+        };
+
+        for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+            lua_pushcfunction(L, ptr->func);
+            lua_setfield(L, -2, ptr->name);
+        }
+        lua_pop(L, 1);
+    }
+#endif
+    // create metatable for the arrays
+    if (luaL_newmetatable(L, ARRAY_MT)) {
+        struct luaL_Reg mmethod[] = {
+            {"__len",      array_len_lua  },
+            {"__tostring", array_tostr_lua},
+            {NULL,         NULL           }
+        };
+        struct luaL_Reg method[] = {
+            {"fromtable", array_fromtable_lua},
+            {"totable",   array_totable_lua  },
+            {"ptr",       array_ptr_lua      },
+            {NULL,        NULL               }
+        };
+
+        for (struct luaL_Reg *ptr = mmethod; ptr->name; ptr++) {
+            lua_pushcfunction(L, ptr->func);
+            lua_setfield(L, -2, ptr->name);
+        }
+        lua_createtable(L, 0, 3);
+        for (struct luaL_Reg *ptr = method; ptr->name; ptr++) {
+            lua_pushcfunction(L, ptr->func);
+            lua_setfield(L, -2, ptr->name);
+        }
+        lua_setfield(L, -2, "__index");
+        lua_pop(L, 1);
+    }
+
+    // create module table
+    lua_createtable(L, 0, 1);
+    {
+        struct luaL_Reg funcs[] = {
+            {"tostring",   tostring_ptr_lua},
+            {"buffer",     buffer_lua      },
+            {"array",      array_lua       },
+            {"defstruct",  defstruct_lua   },
+            {"read",       read_lua        },
+            {"write",      write_lua       },
+            {"callback",   callback_lua    },
+            {"comparator", comparator_lua  },
+            {"errno",      errno_lua       },
+            {"load",       load_lua        },
+            {NULL,         NULL            }
+        };
 
-    lua_pushcfunction(L, new_lua);
+        for (struct luaL_Reg *ptr = funcs; ptr->name; ptr++) {
+            lua_pushcfunction(L, ptr->func);
+            lua_setfield(L, -2, ptr->name);
+        }
+    }
+    // dlopen(path) creates a new dso
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, call_lua);
+    lua_setfield(L, -2, "__call");
+    lua_setmetatable(L, -2);
     return 1;
 }
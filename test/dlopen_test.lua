@@ -79,8 +79,10 @@ local function build_test_lib(source)
     f:close()
 
     -- Compile (Lua 5.4: os.execute returns true, "exit", exit_code)
+    -- link libc explicitly, so that its functions can be found through the
+    -- handle even if the linker drops unused libraries by default
     local build_cmd = "gcc -shared -fPIC -Wall -O2 -o " .. so_file .. " " ..
-                          c_file .. " 2>&1"
+                          c_file .. " -Wl,--no-as-needed -lc 2>&1"
     local res, reason, code = os.execute(build_cmd)
     if type(res) ~= "number" then
         res = reason == "exit" and code or -1
@@ -224,7 +226,7 @@ int process_char_ptr(char* str) {
         lib:process_char_ptr(ptr)
     end)
     assert_equal(false, ok2, "char* should reject lightuserdata")
-    assert_match("char%* requires nil or string", err2,
+    assert_match("char%* requires nil, string or buffer", err2,
                  "Wrong error message: " .. tostring(err2))
 end)
 
@@ -659,6 +661,1123 @@ int64_t test_large(int64_t x) { return x; }
     assert_equal(large_val, result, "test_large should handle large integers")
 end)
 
+run_test("symbol access returns the same closure", function()
+    local lib = build_test_lib([[
+int add(int a, int b) { return a + b; }
+]])
+    lib:dlsym("int", "add", "int", "int")
+    local fn = lib.add
+    assert_true(rawequal(fn, lib.add),
+                "symbol access should return the cached closure")
+    assert_equal(3, fn(lib, 1, 2), "cached closure should be callable")
+end)
+
+run_test("unknown field access raises error", function()
+    local lib = build_test_lib([[
+int add(int a, int b) { return a + b; }
+]])
+    lib:dlsym("int", "add", "int", "int")
+    local ok, err = pcall(function()
+        return lib.sub
+    end)
+    assert_equal(false, ok, "Should fail to access unknown field")
+    assert_match("unknown field 'sub'", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("names of methods cannot be used as symbols", function()
+    local lib = build_test_lib([[
+int dlclose(void) { return 42; }
+int dump(void) { return 42; }
+]])
+    local ok, err = lib:dlsym("int", "dlclose")
+    assert_equal(false, ok, "dlclose should not be defined")
+    assert_match("'dlclose' is the name of a method", err,
+                 "Wrong error message: " .. tostring(err))
+    local errs
+    ok, errs = lib:dlsym_many({
+        {"int", "dump"},
+    })
+    assert_equal(false, ok, "dump should not be defined")
+    assert_match("'dump' is the name of a method", errs[1],
+                 "Wrong error message: " .. tostring(errs[1]))
+    ok, err = pcall(lib.func, lib, "dump")
+    assert_equal(false, ok, "dump should not be a symbol")
+    assert_match("symbol 'dump' is not defined", err,
+                 "Wrong error message: " .. tostring(err))
+    assert_equal(true, lib:dlclose(), "dlclose method should be called")
+end)
+
+run_test("latest definition of a symbol is called", function()
+    local lib = build_test_lib([[
+int add(int a, int b) { return a + b; }
+]])
+    assert_true(lib:dlsym("int", "add", "int"))
+    assert_true(lib:dlsym("int", "add", "int", "int"))
+    assert_equal(3, lib:add(1, 2), "should call the latest definition")
+end)
+
+run_test("func returns standalone function", function()
+    local lib = build_test_lib([[
+int add(int a, int b) { return a + b; }
+]])
+    lib:dlsym("int", "add", "int", "int")
+    local add = lib:func("add")
+    assert_equal("function", type(add), "func should return a function")
+    assert_equal(30, add(10, 20), "add should return 30")
+
+    -- undefined symbol
+    local ok, err = pcall(function()
+        lib:func("sub")
+    end)
+    assert_equal(false, ok, "func should fail for undefined symbol")
+    assert_match("symbol 'sub' is not defined", err,
+                 "Wrong error message: " .. tostring(err))
+
+    -- function cannot be called after the module is closed
+    lib:dlclose()
+    ok, err = pcall(add, 1, 2)
+    assert_equal(false, ok, "Should fail to call function of closed module")
+    assert_match("module is closed", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("narrow integer and double arguments", function()
+    local lib = build_test_lib([[
+short mix4(signed char a, double b, unsigned short c, double d) {
+    return (short)(a + b + c + d);
+}
+]])
+    local ok, err = lib:dlsym("short", "mix4", "signed char", "double",
+                              "unsigned short", "double")
+    assert_true(ok, "Failed to define mix4: " .. tostring(err))
+    assert_equal(-5, lib:mix4(-10, 1.5, 2, 1.5), "mix4 should return -5")
+end)
+
+run_test("unchecked option skips argument validation", function()
+    local lib = build_test_lib([[
+#include <string.h>
+int add(int a, int b) { return a + b; }
+size_t len(const char *s) { return s ? strlen(s) : 0; }
+void *ptr(void *p) { return p; }
+size_t blen(const char *p, size_t n) { return p ? n : (size_t)-1; }
+]])
+    assert_true(lib:dlsym("int", "add", "int", "int", {
+        unchecked = true,
+    }))
+    assert_true(lib:dlsym("size_t", "len", "char*", {
+        unchecked = true,
+    }))
+    assert_true(lib:dlsym("void*", "ptr", "void*", {
+        unchecked = true,
+    }))
+    assert_equal(30, lib:add(10, 20), "add should return 30")
+    assert_equal(5, lib:len("hello"), "len should return 5")
+    assert_equal(0, lib:len(nil), "len should return 0 for nil")
+    assert_equal(nil, lib:ptr(nil), "ptr should return nil for nil")
+    -- a buffer and an array are passed as their memory block
+    assert_true(lib:dlsym("size_t", "blen", "bytes", {
+        unchecked = true,
+    }))
+    assert_equal(3, lib:blen("abc"))
+    assert_equal(16, lib:blen(dlopen.buffer(16)),
+                 "should pass the memory of the buffer")
+    assert_equal(8, lib:blen(dlopen.array("int32", 2)),
+                 "should pass the memory of the array")
+    -- argument count is still checked
+    local ok, err = pcall(function()
+        lib:add(1)
+    end)
+    assert_equal(false, ok, "Should fail with wrong argument count")
+    assert_match("invalid number of arguments", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("retlen option returns string with length of out argument", function()
+    local lib = build_test_lib([[
+#include <stddef.h>
+static const char DATA[] = {'a', 0, 'b', 0, 'c'};
+const char *get_data(int n, size_t *len) {
+    if (n < 0) return NULL;
+    *len = n;
+    return DATA;
+}
+]])
+    local ok, err = lib:dlsym("char*", "get_data", "int", "size_t*", {
+        retlen = 2,
+    })
+    assert_true(ok, "Failed to define get_data: " .. tostring(err))
+    assert_equal("a\0b\0c", lib:get_data(5), "should return binary string")
+    assert_equal("a\0b", lib:get_data(3), "should return 3 bytes")
+    assert_equal(nil, lib:get_data(-1), "should return nil for NULL")
+
+    -- size_t* without retlen is returned as the extra result
+    ok, err = lib:dlsym("char*", "get_data", "int", "size_t*")
+    assert_true(ok, "Failed to define get_data: " .. tostring(err))
+    local str, len = lib:get_data(5)
+    assert_equal("a", str, "should return string until NUL")
+    assert_equal(5, len, "should return output value")
+
+    -- retlen must point to size_t* argument
+    ok, err = lib:dlsym("char*", "get_data", "int", "size_t*", {
+        retlen = 1,
+    })
+    assert_equal(false, ok, "retlen must point to size_t* argument")
+    assert_match("retlen must be the position", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("retlen option returns string with length of paired call", function()
+    local lib = build_test_lib([[
+static const char DATA[] = {'x', 0, 'y'};
+const char *buf_data(void *obj) { return DATA; }
+long buf_size(void *obj) { return obj ? sizeof(DATA) : -1; }
+const char *out_data(int *out) { *out = 111; return "abcdef"; }
+long out_size(int *out) { *out = 222; return 3; }
+]])
+    assert_true(lib:dlsym("long", "buf_size", "void*"))
+    local ok, err = lib:dlsym("char*", "buf_data", "void*", {
+        retlen = "buf_size",
+    })
+    assert_true(ok, "Failed to define buf_data: " .. tostring(err))
+    local ptr = lib:buf_data(nil)
+    assert_equal(nil, ptr, "negative length should return nil")
+    local obj = require("assert.lightuserdata")
+    assert_equal("x\0y", lib:buf_data(obj), "should return binary string")
+
+    -- the pair does not overwrite the output values
+    assert_true(lib:dlsym("long", "out_size", "int*"))
+    assert_true(lib:dlsym("char*", "out_data", "int*", {
+        retlen = "out_size",
+    }))
+    local str, out = lib:out_data()
+    assert_equal("abc", str)
+    assert_equal(111, out, "should return the output value of the symbol")
+
+    -- the lazy length symbol is resolved with the symbol
+    assert_true(lib:dlsym("long", "buf_size", "void*", {lazy = true}))
+    assert_true(lib:dlsym("char*", "buf_data", "void*", {
+        retlen = "buf_size",
+    }))
+    assert_equal("x\0y", lib:buf_data(obj),
+                 "should call the lazy length symbol")
+    assert_true(lib:dlsym("long", "no_such_size", "void*", {lazy = true}))
+    ok, err = lib:dlsym("char*", "buf_data", "void*", {
+        retlen = "no_such_size",
+    })
+    assert_equal(false, ok, "missing lazy length symbol should fail")
+    assert_match("failed to find symbol 'no_such_size'", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = lib:dlsym("char*", "buf_data", "void*", {
+        retlen = "unknown",
+    })
+    assert_equal(false, ok, "undefined retlen symbol should fail")
+    assert_match("retlen symbol 'unknown' is not defined", err,
+                 "Wrong error message: " .. tostring(err))
+
+    -- the pair is called with the same arguments
+    assert_true(lib:dlsym("long", "buf_size", "void*", "..."))
+    ok, err = lib:dlsym("char*", "buf_data", "void*", {
+        retlen = "buf_size",
+    })
+    assert_equal(false, ok, "variadic retlen symbol should fail")
+    assert_match("retlen symbol 'buf_size' cannot take struct or variadic",
+                 err, "Wrong error message: " .. tostring(err))
+    assert_true(lib:dlsym("double", "buf_size", "void*"))
+    ok, err = lib:dlsym("char*", "buf_data", "void*", {
+        retlen = "buf_size",
+    })
+    assert_equal(false, ok, "non-integer retlen symbol should fail")
+    assert_match("retlen symbol 'buf_size' must return an integer", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("tostring copies memory of pointer", function()
+    local lib = build_test_lib([[
+const char *get_str(void) { return "hello\0world"; }
+]])
+    assert_true(lib:dlsym("void*", "get_str"))
+    local ptr = lib:get_str()
+    assert_equal("userdata", type(ptr), "should return lightuserdata")
+    assert_equal("hello", dlopen.tostring(ptr), "should copy until NUL")
+    assert_equal("hello\0world", dlopen.tostring(ptr, 11),
+                 "should copy specified length")
+    assert_equal(nil, dlopen.tostring(nil), "should return nil for nil")
+end)
+
+run_test("bytes argument passes pointer and length", function()
+    local lib = build_test_lib([[
+#include <stddef.h>
+long count_nul(int base, const char *buf, size_t len, int add) {
+    long n = 0;
+    if (!buf) return -1;
+    for (size_t i = 0; i < len; i++) {
+        n += (buf[i] == 0);
+    }
+    return base + n * 10 + (long)len * 100 + add;
+}
+]])
+    local ok, err = lib:dlsym("long", "count_nul", "int", "bytes", "int")
+    assert_true(ok, "Failed to define count_nul: " .. tostring(err))
+    assert_equal(2 + 20 + 500 + 3, lib:count_nul(2, "a\0b\0c", 3),
+                 "should pass binary string with length")
+    assert_equal(-1, lib:count_nul(0, nil, 0), "should pass NULL for nil")
+
+    local ok2, err2 = pcall(function()
+        lib:count_nul(0, 123, 0)
+    end)
+    assert_equal(false, ok2, "bytes should reject number")
+    assert_match("bytes requires nil, string or userdata", err2,
+                 "Wrong error message: " .. tostring(err2))
+
+    ok, err = lib:dlsym("bytes", "count_nul", "int", "bytes", "int")
+    assert_equal(false, ok, "bytes cannot be used as return type")
+    assert_match("bytes cannot be used as return type", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("callmany calls symbol over argument tuples", function()
+    local lib = build_test_lib([[
+int add(int a, int b) { return a + b; }
+int twice(int a) { return a * 2; }
+]])
+    assert_true(lib:dlsym("int", "add", "int", "int"))
+    assert_true(lib:dlsym("int", "twice", "int"))
+
+    local res = lib:callmany("add", {
+        {1, 2},
+        {3, 4},
+        {5, 6},
+    })
+    assert_equal(3, #res, "should return a result per tuple")
+    assert_equal(3, res[1])
+    assert_equal(7, res[2])
+    assert_equal(11, res[3])
+
+    res = lib:callmany("twice", {1, {2}, 3})
+    assert_equal(2, res[1])
+    assert_equal(4, res[2])
+    assert_equal(6, res[3])
+    assert_equal(0, #lib:callmany("add", {}), "should return empty table")
+
+    local ok, err = pcall(function()
+        lib:callmany("add", {{1, 2}, 3})
+    end)
+    assert_equal(false, ok, "non-table element should fail")
+    assert_match("element #2 must be a table of arguments", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        lib:callmany("unknown", {})
+    end)
+    assert_equal(false, ok, "undefined symbol should fail")
+    assert_match("symbol 'unknown' is not defined", err,
+                 "Wrong error message: " .. tostring(err))
+
+    lib:dlclose()
+    ok, err = pcall(function()
+        lib:callmany("add", {})
+    end)
+    assert_equal(false, ok, "closed module should fail")
+end)
+
+run_test("buffer is passed as writable memory", function()
+    local lib = build_test_lib([[
+#include <stdio.h>
+#include <string.h>
+int fmt(char *buf, int n) { return snprintf(buf, 16, "n=%d", n); }
+void upper(void *buf, size_t len) {
+    char *p = buf;
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] >= 'a' && p[i] <= 'z') p[i] -= 32;
+    }
+}
+size_t fill_x(const char *buf, size_t len) {
+    memset((char *)buf, 'x', len);
+    return len;
+}
+]])
+    assert_true(lib:dlsym("int", "fmt", "char*", "int"))
+    assert_true(lib:dlsym("void", "upper", "void*", "size_t"))
+    assert_true(lib:dlsym("size_t", "fill_x", "bytes"))
+
+    local buf = dlopen.buffer(16)
+    assert_equal(16, #buf, "should have specified length")
+    assert_equal(16, buf:cap(), "should have specified capacity")
+    assert_equal(string.rep("\0", 16), buf:tostring(),
+                 "should be filled with zeros")
+
+    local n = lib:fmt(buf, 42)
+    assert_equal("n=42", buf:tostring(0, n), "char* should write into buffer")
+    lib:upper(buf, n)
+    assert_equal("N=42", buf:tostring(0, n), "void* should write into buffer")
+    assert_equal("42", buf:tostring(2, 2), "should copy from offset")
+
+    -- resize keeps the capacity when shrinking
+    assert_equal(buf, buf:resize(3))
+    assert_equal(3, #buf)
+    assert_equal(16, buf:cap())
+    assert_equal(3, lib:fill_x(buf), "bytes should pass length of buffer")
+    assert_equal("xxx", buf:tostring())
+    buf:resize(32)
+    assert_equal(32, buf:cap(), "should grow capacity")
+    assert_equal("xxx\0", buf:tostring(0, 4),
+                 "should keep contents and zero the bytes left by shrink")
+    assert_equal(string.rep("\0", 16), buf:tostring(16),
+                 "should zero new memory")
+
+    assert_equal(buf, buf:fill(0x61, 1, 2))
+    assert_equal("xaa\0", buf:tostring(0, 4))
+    buf:fill()
+    assert_equal(string.rep("\0", 32), buf:tostring())
+    assert_equal("userdata", type(buf:ptr(4)))
+
+    local ok, err = pcall(function()
+        buf:tostring(30, 3)
+    end)
+    assert_equal(false, ok, "should fail out of range")
+    assert_match("length out of range", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("array converts elements from and to tables", function()
+    local lib = build_test_lib([[
+#include <stddef.h>
+#include <stdint.h>
+double sum(const double *v, size_t n) {
+    double s = 0;
+    for (size_t i = 0; i < n; i++) s += v[i];
+    return s;
+}
+void scale(int32_t *v, size_t n, int32_t k) {
+    for (size_t i = 0; i < n; i++) v[i] *= k;
+}
+size_t nbytes(const void *p, size_t len) { return p ? len : 0; }
+]])
+    assert_true(lib:dlsym("double", "sum", "void*", "size_t"))
+    assert_true(lib:dlsym("void", "scale", "void*", "size_t", "int32"))
+    assert_true(lib:dlsym("size_t", "nbytes", "bytes"))
+
+    local arr = dlopen.array("double", 3)
+    assert_equal(3, #arr, "should have specified length")
+    assert_equal(arr, arr:fromtable({1.5, 2.5, 3}))
+    assert_equal(7.0, lib:sum(arr, #arr), "should pass memory of array")
+    assert_equal(24, lib:nbytes(arr), "bytes should pass size in bytes")
+
+    local ints = dlopen.array("int32", 4):fromtable({1, 2, 3, 4})
+    lib:scale(ints, #ints, -2)
+    local tbl = ints:totable()
+    assert_equal(4, #tbl)
+    assert_equal(-2, tbl[1])
+    assert_equal(-8, tbl[4])
+    tbl = ints:totable(1, 2)
+    assert_equal(2, #tbl, "should copy specified length")
+    assert_equal(-4, tbl[1], "should copy from offset")
+    assert_equal(-6, tbl[2])
+    ints:fromtable({9}, 3)
+    assert_equal(9, ints:totable(3)[1], "should copy to offset")
+
+    local ok, err = pcall(function()
+        ints:fromtable({1, 2, 3, 4, 5})
+    end)
+    assert_equal(false, ok, "should fail with too many elements")
+    assert_match("too many elements", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        ints:fromtable({1, 1.5})
+    end)
+    assert_equal(false, ok, "should fail with non-integral number")
+    assert_match("element #2 must be an integer", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        ints:fromtable({1, "x"})
+    end)
+    assert_equal(false, ok, "should fail with non-number element")
+    assert_match("element #2 must be a number", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        dlopen.array("char*", 1)
+    end)
+    assert_equal(false, ok, "should fail with unsupported type")
+    assert_match("unsupported element type", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("output arguments are returned as extra results", function()
+    local lib = build_test_lib([[
+#include <stddef.h>
+#include <stdlib.h>
+int divmod(int a, int b, int *q, long *r) {
+    if (b == 0) return -1;
+    *q = a / b;
+    *r = a % b;
+    return 0;
+}
+void split(double v, double *ip, double *fp) {
+    *ip = (double)(long)v;
+    *fp = v - *ip;
+}
+void incr(int *v, size_t *n) {
+    *v += 1;
+    *n += 10;
+}
+void *self(void *p, void **out) {
+    *out = p;
+    return p;
+}
+]])
+    local ok, err = lib:dlsym("int", "divmod", "int", "int", "int*", "long*")
+    assert_true(ok, "Failed to define divmod: " .. tostring(err))
+    local rv, q, r = lib:divmod(17, 5)
+    assert_equal(0, rv, "should return primary value first")
+    assert_equal(3, q, "should return int* value")
+    assert_equal(2, r, "should return long* value")
+    rv, q, r = lib:divmod(1, 0)
+    assert_equal(-1, rv)
+    assert_equal(0, q, "unwritten output should be zero")
+    assert_equal(0, r, "unwritten output should be zero")
+
+    assert_true(lib:dlsym("void", "split", "double", "double*", "double*"))
+    local ip, fp = lib:split(2.5)
+    assert_equal(2.0, ip, "void function should return outputs only")
+    assert_equal(0.5, fp)
+
+    -- in/out arguments take the input value from Lua
+    assert_true(lib:dlsym("void", "incr", "int&", "size_t&"))
+    local v, n = lib:incr(41, 5)
+    assert_equal(42, v, "should return updated int& value")
+    assert_equal(15, n, "should return updated size_t& value")
+
+    assert_true(lib:dlsym("void*", "self", "void*", "void**"))
+    local ptr = require("assert.lightuserdata")
+    local p1, p2 = lib:self(ptr)
+    assert_equal(ptr, p1)
+    assert_equal(ptr, p2, "should return void** value")
+
+    -- strtol returns the rest of the string with char**
+    assert_true(lib:dlsym("long", "strtol", "char*", "char**", "int"))
+    local num, rest = lib:strtol("123abc", 10)
+    assert_equal(123, num)
+    assert_equal("abc", rest, "should return char** value as string")
+
+    ok, err = lib:dlsym("void", "incr", "void&", "size_t*")
+    assert_equal(false, ok, "void& should fail")
+    assert_match("void& cannot be used as argument type", err,
+                 "Wrong error message: " .. tostring(err))
+    ok, err = lib:dlsym("void", "incr", "bytes*", "size_t*")
+    assert_equal(false, ok, "bytes* should fail")
+end)
+
+run_test("defstruct passes and returns struct by value", function()
+    local lib = build_test_lib([[
+struct point { char tag; double x; int y; };
+struct rect { struct point min; struct point max; const char *name; };
+struct point make_point(char tag, double x, int y) {
+    struct point p = {tag, x, y};
+    return p;
+}
+double area(struct rect r) {
+    return (r.max.x - r.min.x) * (double)(r.max.y - r.min.y);
+}
+struct rect grow(struct rect r, int n, int *count) {
+    r.max.x += n;
+    r.max.y += n;
+    *count = n;
+    return r;
+}
+]])
+    local point = dlopen.defstruct("test_point", {
+        "tag@char",
+        "x@double",
+        "y@int",
+    })
+    assert_equal(24, point:size(), "should compute size with alignment")
+    assert_equal(8, point:offset("x"), "should align double field")
+    assert_equal(16, point:offset("y"))
+    local rect = dlopen.defstruct("test_rect", {
+        "min@test_point",
+        "max@test_point",
+        "name@char*",
+    })
+
+    local ok, err = lib:dlsym("test_point", "make_point", "char", "double",
+                              "int")
+    assert_true(ok, "Failed to define make_point: " .. tostring(err))
+    local p = lib:make_point(65, 1.5, -3)
+    assert_equal("table", type(p), "should return table")
+    assert_equal(65, p.tag)
+    assert_equal(1.5, p.x)
+    assert_equal(-3, p.y)
+
+    -- struct type object can be used instead of the name
+    assert_true(lib:dlsym("double", "area", rect))
+    assert_equal(12.0, lib:area({
+        min = {x = 1, y = 1},
+        max = {x = 4, y = 5},
+    }), "should pass nested struct by value")
+
+    assert_true(lib:dlsym("test_rect", "grow", "test_rect", "int", "int*"))
+    local r, count = lib:grow({
+        max = {x = 1, y = 2},
+        name = "box",
+    }, 3)
+    assert_equal(4.0, r.max.x, "should return nested struct")
+    assert_equal(5, r.max.y)
+    assert_equal(0, r.min.x, "missing field should be zero")
+    assert_equal("box", r.name)
+    assert_equal(3, count, "should return output argument after struct")
+
+    local ok2, err2 = pcall(function()
+        lib:area(1)
+    end)
+    assert_equal(false, ok2, "non-table should fail")
+    assert_match("struct test_rect requires table", err2,
+                 "Wrong error message: " .. tostring(err2))
+
+    ok2, err2 = pcall(function()
+        lib:area({min = {x = "a"}})
+    end)
+    assert_equal(false, ok2, "wrong field type should fail")
+    assert_match("field 'x' of struct test_point requires double", err2,
+                 "Wrong error message: " .. tostring(err2))
+
+    ok2, err2 = pcall(function()
+        lib:area({min = {y = 1.5}})
+    end)
+    assert_equal(false, ok2, "non-integral number should fail")
+    assert_match("field 'y' must be an integer", err2,
+                 "Wrong error message: " .. tostring(err2))
+
+    ok2, err2 = pcall(function()
+        dlopen.defstruct("test_point", {"x@int"})
+    end)
+    assert_equal(false, ok2, "redefinition should fail")
+    assert_match("struct 'test_point' is already defined", err2,
+                 "Wrong error message: " .. tostring(err2))
+
+    ok2, err2 = pcall(function()
+        dlopen.defstruct("test_bad", {"x@unknown"})
+    end)
+    assert_equal(false, ok2, "unknown field type should fail")
+    assert_match("unknown type 'unknown'", err2,
+                 "Wrong error message: " .. tostring(err2))
+end)
+
+run_test("read and write values through pointers", function()
+    local lib = build_test_lib([[
+#include <stdint.h>
+struct node { int value; struct node *next; const char *name; };
+static struct node n2 = {2, 0, "second"};
+static struct node n1 = {1, &n2, "first"};
+static int64_t nums[] = {10, -20, 30};
+void *get_list(void) { return &n1; }
+void *get_nums(void) { return nums; }
+]])
+    assert_true(lib:dlsym("void*", "get_list"))
+    assert_true(lib:dlsym("void*", "get_nums"))
+    local node = dlopen.defstruct("test_node", {
+        "value@int",
+        "next@void*",
+        "name@char*",
+    })
+
+    -- walk the list owned by C
+    local names = {}
+    local ptr = lib:get_list()
+    while ptr do
+        local n = dlopen.read(ptr, node, 0)
+        names[#names + 1] = n.name .. "=" .. n.value
+        ptr = n.next
+    end
+    assert_equal("first=1,second=2", table.concat(names, ","),
+                 "should read struct through pointer")
+    ptr = lib:get_list()
+    assert_equal("first", dlopen.read(ptr, "char*", node:offset("name")),
+                 "should read field by offset")
+
+    -- bulk read and write
+    local nums = lib:get_nums()
+    local tbl = dlopen.read(nums, "int64", 0, 3)
+    assert_equal(3, #tbl)
+    assert_equal(10, tbl[1])
+    assert_equal(-20, tbl[2])
+    assert_equal(30, tbl[3])
+    dlopen.write(nums, "int64", 8, {-1, -2})
+    assert_equal(-2, dlopen.read(nums, "int64", 16))
+
+    local buf = dlopen.buffer(8)
+    dlopen.write(buf, "uint16", 2, 0x1234)
+    assert_equal(0x1234, dlopen.read(buf, "uint16", 2))
+    dlopen.write(buf, "double", 0, 1.5)
+    assert_equal(1.5, dlopen.read(buf, "double", 0))
+
+    local ok, err = pcall(function()
+        dlopen.read(buf, "double", 4)
+    end)
+    assert_equal(false, ok, "should fail out of range of buffer")
+    assert_match("out of range", err, "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        dlopen.write(buf, "char*", 0, "x")
+    end)
+    assert_equal(false, ok, "should fail to write char*")
+    assert_match("char%* cannot be written", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        dlopen.write(buf, "uint16", 0, 1.5)
+    end)
+    assert_equal(false, ok, "should fail to write non-integral number")
+    assert_match("uint16 requires an integer", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("callback passes Lua function as C function pointer", function()
+    local lib = build_test_lib([[
+#include <stdlib.h>
+struct pair { int a; double b; };
+double apply(double (*fn)(double, int), double x, int n) { return fn(x, n); }
+int sum_pair(struct pair (*fn)(int), int v) {
+    struct pair p = fn(v);
+    return p.a + (int)p.b;
+}
+int call_char(char (*fn)(const char *)) { return fn("hello"); }
+]])
+    assert_true(lib:dlsym("double", "apply", "void*", "double", "int"))
+    assert_true(lib:dlsym("int", "sum_pair", "void*", "int"))
+    assert_true(lib:dlsym("int", "call_char", "void*"))
+    assert_true(lib:dlsym("void", "qsort", "void*", "size_t", "size_t",
+                          "void*"))
+
+    local cb = dlopen.callback(function(x, n)
+        return x * n
+    end, "double", "double", "int")
+    assert_equal(7.5, lib:apply(cb, 2.5, 3), "should call Lua function")
+
+    dlopen.defstruct("test_cb_pair", {"a@int", "b@double"})
+    local cb2 = dlopen.callback(function(v)
+        return {a = v, b = v * 2}
+    end, "test_cb_pair", "int")
+    assert_equal(12, lib:sum_pair(cb2, 4), "should return struct value")
+
+    local cb3 = dlopen.callback(function(s)
+        return -#s
+    end, "char", "char*")
+    assert_equal(-5, lib:call_char(cb3),
+                 "should pass string and widen narrow return value")
+
+    local cmp = dlopen.callback(function(a, b)
+        return dlopen.read(a, "int", 0) - dlopen.read(b, "int", 0)
+    end, "int", "void*", "void*")
+    local arr = dlopen.array("int", 5):fromtable({5, 3, 4, 1, 2})
+    lib:qsort(arr, #arr, 4, cmp)
+    assert_equal("1,2,3,4,5", table.concat(arr:totable(), ","),
+                 "should sort with Lua comparator")
+
+    local ok, err = pcall(function()
+        lib:apply(dlopen.callback(function()
+            error("callback error")
+        end, "double", "double", "int"), 1, 1)
+    end)
+    assert_equal(false, ok, "error should be propagated")
+    assert_match("callback error", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        dlopen.callback(function()
+        end, "char*")
+    end)
+    assert_equal(false, ok, "char* return type should fail")
+    assert_match("char%* cannot be used as return type", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("callback runs on the thread that calls the C function", function()
+    local lib = build_test_lib([[
+int apply(int (*fn)(int), int v) { return fn(v); }
+]])
+    assert_true(lib:dlsym("int", "apply", "void*", "int"))
+
+    -- created in a coroutine that has finished
+    local cb = coroutine.wrap(function()
+        return dlopen.callback(function(v)
+            return v + 1
+        end, "int", "int")
+    end)()
+    assert_equal(2, lib:apply(cb, 1), "should run on the calling thread")
+
+    local co = coroutine.create(function(v)
+        v = coroutine.yield(lib:apply(cb, v))
+        return lib:apply(cb, v)
+    end)
+    local _, v = coroutine.resume(co, 10)
+    assert_equal(11, v, "should run on the coroutine")
+    assert_equal(3, lib:apply(cb, 2), "should run while the other suspended")
+    _, v = coroutine.resume(co, 20)
+    assert_equal(21, v)
+
+    -- the error of the conversion is raised after the C function returns
+    local bad = dlopen.callback(function()
+        return "x"
+    end, "int", "int")
+    local ok, err = pcall(lib.apply, lib, bad, 1)
+    assert_equal(false, ok, "conversion error should be propagated")
+    assert_match("number expected", err,
+                 "Wrong error message: " .. tostring(err))
+    assert_equal(2, lib:apply(cb, 1), "should be callable after the error")
+end)
+
+run_test("comparator returns native comparator functions", function()
+    local lib = build_test_lib([[
+#include <stdlib.h>
+static const char *WORDS[] = {"pear", "apple", "fig"};
+const char *sorted_word(void *cmp, int i) {
+    const char *words[3] = {WORDS[0], WORDS[1], WORDS[2]};
+    qsort(words, 3, sizeof(char *), (int (*)(const void *, const void *))cmp);
+    return words[i];
+}
+]])
+    assert_true(lib:dlsym("void", "qsort", "void*", "size_t", "size_t",
+                          "void*"))
+    assert_true(lib:dlsym("void*", "bsearch", "void*", "void*", "size_t",
+                          "size_t", "void*"))
+    assert_true(lib:dlsym("char*", "sorted_word", "void*", "int"))
+
+    local cmp = dlopen.comparator("int32")
+    assert_equal("userdata", type(cmp), "should return lightuserdata")
+    local arr = dlopen.array("int32", 5):fromtable({5, -3, 4, 1, 2})
+    lib:qsort(arr, #arr, 4, cmp)
+    assert_equal("-3,1,2,4,5", table.concat(arr:totable(), ","))
+    lib:qsort(arr, #arr, 4, dlopen.comparator("int32", true))
+    assert_equal("5,4,2,1,-3", table.concat(arr:totable(), ","),
+                 "should sort in descending order")
+
+    local darr = dlopen.array("double", 3):fromtable({2.5, -1, 3})
+    lib:qsort(darr, #darr, 8, dlopen.comparator("double"))
+    assert_equal(-1, darr:totable()[1])
+    local key = dlopen.array("double", 1):fromtable({2.5})
+    local found = lib:bsearch(key, darr, #darr, 8, dlopen.comparator("double"))
+    assert_equal(2.5, dlopen.read(found, "double", 0), "should find key")
+
+    assert_equal("apple", lib:sorted_word(dlopen.comparator("char*"), 0))
+    assert_equal("pear",
+                 lib:sorted_word(dlopen.comparator("char*", true), 0),
+                 "should compare strings in descending order")
+
+    local ok, err = pcall(function()
+        dlopen.comparator("bytes")
+    end)
+    assert_equal(false, ok, "unsupported type should fail")
+    assert_match("unsupported type", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("variadic functions take the types of the variadic arguments",
+         function()
+    local lib = build_test_lib([[
+#include <stdarg.h>
+double sum(int n, ...) {
+    va_list ap;
+    double total = 0;
+    va_start(ap, n);
+    for (int i = 0; i < n; i++) {
+        total += va_arg(ap, double);
+    }
+    va_end(ap);
+    return total;
+}
+]])
+    assert_true(lib:dlsym("int", "snprintf", "char*", "size_t", "char*",
+                          "..."))
+    assert_true(lib:dlsym("double", "sum", "int", "..."))
+
+    local buf = dlopen.buffer(32)
+    local n = lib:snprintf(buf, #buf, "%d %s %.1f", "int, char*, double", 42,
+                           "foo", 1.5)
+    assert_equal("42 foo 1.5", buf:tostring(0, n))
+    -- the cached call interface is reused for the same types
+    n = lib:snprintf(buf, #buf, "%d %s %.1f", "int, char*, double", 7, "b", 2)
+    assert_equal("7 b 2.0", buf:tostring(0, n))
+    n = lib:snprintf(buf, #buf, "%c%hd", "char,short", 65, -1)
+    assert_equal("A-1", buf:tostring(0, n), "should promote small integers")
+    n = lib:snprintf(buf, #buf, "none", "")
+    assert_equal("none", buf:tostring(0, n), "should accept empty signature")
+
+    assert_equal(6, lib:sum(3, "double,double,double", 1, 2, 3))
+    assert_equal(2.5, lib:sum(1, "float", 2.5), "should promote float")
+
+    local ok, err = pcall(function()
+        lib:sum(2, "double", 1, 2)
+    end)
+    assert_equal(false, ok, "extra argument should fail")
+    assert_match("expected 3 but got 4", err,
+                 "Wrong error message: " .. tostring(err))
+
+    ok, err = pcall(function()
+        lib:sum(1, "double,void", 1)
+    end)
+    assert_equal(false, ok, "void should fail")
+    assert_match("invalid type of variadic argument 'void'", err,
+                 "Wrong error message: " .. tostring(err))
+
+    for _, sig in ipairs({
+        "double,",
+        "double,,double",
+        " , double",
+    }) do
+        ok, err = pcall(function()
+            lib:sum(2, sig, 1, 2)
+        end)
+        assert_equal(false, ok, "empty type should fail: " .. sig)
+        assert_match("empty type in the signature", err,
+                     "Wrong error message: " .. tostring(err))
+    end
+
+    -- many shapes of the variadic arguments are still called correctly
+    -- while the least recently used call interfaces are dropped
+    local unpack = table.unpack or unpack
+    for i = 1, 40 do
+        local types = {}
+        local args = {}
+        for j = 1, i % 20 + 1 do
+            types[j] = (j % 2 == 0) and "float" or "double"
+            args[j] = j
+        end
+        local sig = table.concat(types, (i > 20) and ", " or ",")
+        assert_equal(#args * (#args + 1) / 2,
+                     lib:sum(#args, sig, unpack(args)))
+    end
+
+    ok, err = lib:dlsym("int", "printf", "...", "char*")
+    assert_equal(false, ok, "... must be the last")
+    assert_match("must be the last argument type", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("errno option captures errno after the call", function()
+    local lib = build_test_lib([[
+#include <errno.h>
+int fail(int e) {
+    if (e) {
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+]])
+    assert_true(lib:dlsym("int", "fail", "int", {
+        errno = true,
+    }))
+
+    local rv, err = lib:fail(34)
+    assert_equal(-1, rv)
+    assert_equal(34, err, "should return errno as extra result")
+    assert_equal(34, dlopen.errno(), "should store errno in the slot")
+
+    rv, err = lib:fail(0)
+    assert_equal(0, rv)
+    assert_equal(0, err, "should clear errno before the call")
+    assert_equal(0, dlopen.errno())
+
+    local fail = lib:func("fail")
+    assert_equal(2, select(2, fail(2)), "bound function should return errno")
+end)
+
+run_test("dlsym_many defines symbols in a batch", function()
+    local lib = build_test_lib([[
+int add(int a, int b) { return a + b; }
+double half(double x) { return x / 2; }
+]])
+    assert_true(lib:dlsym_many({
+        {"int", "add", "int", "int"},
+        {"double", "half", "double"},
+        {"size_t", "strlen", "char*", {unchecked = true}},
+    }))
+    assert_equal(3, lib:add(1, 2))
+    assert_equal(1.5, lib:half(3))
+    assert_equal(5, lib:strlen("hello"))
+
+    local ok, errs = lib:dlsym_many({
+        {"int", "add", "int", "int"},
+        {"int", "no_such_function"},
+        {"int", "add", "unknown_type"},
+    }, {errno = true})
+    assert_equal(false, ok, "should fail if any symbol fails")
+    assert_equal("table", type(errs))
+    assert_equal(nil, errs[1], "should not report succeeded symbol")
+    assert_match("failed to find symbol 'no_such_function'", errs[2],
+                 "Wrong error message: " .. tostring(errs[2]))
+    assert_match("unknown_type", errs[3],
+                 "Wrong error message: " .. tostring(errs[3]))
+    local rv, err = lib:add(2, 3)
+    assert_equal(5, rv)
+    assert_equal(0, err, "should apply shared options")
+
+    -- the name is not coerced from a number
+    ok, err = pcall(function()
+        lib:dlsym_many({
+            {"int", "add", "int", "int"},
+            {"int", 1234567890123456789, "int"},
+        })
+    end)
+    assert_equal(false, ok, "numeric name should fail")
+    assert_match("element #2: function name must be a string", err,
+                 "Wrong error message: " .. tostring(err))
+    assert_true(lib:dlclose())
+end)
+
+run_test("dump and load the manifest of the symbols", function()
+    local lib = build_test_lib([[
+#include <string.h>
+int add(int a, int b) { return a + b; }
+const char *name(size_t *len) { *len = 3; return "abcdef"; }
+int divmod(int a, int b, int *rem) { *rem = a % b; return a / b; }
+size_t pair_len(int n) { return (size_t)n; }
+const char *pair_str(int n) { return "abcdef"; }
+]])
+    assert_true(lib:dlsym("int", "add", "int", "int"))
+    assert_true(lib:dlsym("char*", "name", "size_t*", {retlen = 1}))
+    assert_true(lib:dlsym("int", "divmod", "int", "int", "int*"))
+    assert_true(lib:dlsym("size_t", "strlen", "bytes", {unchecked = true}))
+    local ok, err = lib:dump("test.manifest")
+    assert_true(ok, err)
+
+    local lib2
+    lib2, err = dlopen.load("test.manifest")
+    os.remove("test.manifest")
+    assert_not_nil(lib2, err)
+    assert_equal(5, lib2:add(2, 3))
+    assert_equal("abc", lib2:name())
+    local q, r = lib2:divmod(7, 2)
+    assert_equal(3, q)
+    assert_equal(1, r)
+    assert_equal(2, lib2:strlen("ab"))
+    assert_true(lib2:dlclose())
+
+    local f = io.open("test.manifest", "wb")
+    f:write("not a manifest")
+    f:close()
+    lib2, err = dlopen.load("test.manifest")
+    os.remove("test.manifest")
+    assert_equal(nil, lib2, "should fail to load invalid manifest")
+    assert_match("invalid manifest", err,
+                 "Wrong error message: " .. tostring(err))
+
+    -- the retlen symbol of the record is checked in the same way as dlsym
+    assert_true(lib:dlsym("size_t", "pair_len", "int"))
+    assert_true(lib:dlsym("char*", "pair_str", "int", {retlen = "pair_len"}))
+    assert_true(lib:dump("test.manifest"))
+    f = io.open("test.manifest", "rb")
+    local data = f:read("*a")
+    f:close()
+    -- replace the return type of pair_len with the one of pair_str. the name
+    -- follows the 16 bytes record and the 2 bytes types of the argument.
+    local len_type = data:find("pair_len\0", 1, true) - 9
+    local str_type = data:find("pair_str\0", 1, true) - 9
+    data = data:sub(1, len_type - 1) .. data:sub(str_type, str_type) ..
+               data:sub(len_type + 1)
+    f = io.open("test.manifest", "wb")
+    f:write(data)
+    f:close()
+    lib2, err = dlopen.load("test.manifest")
+    os.remove("test.manifest")
+    assert_equal(nil, lib2, "should fail to load mismatched retlen symbol")
+    assert_match("invalid manifest: symbol #%d+", err,
+                 "Wrong error message: " .. tostring(err))
+
+    lib2, err = dlopen.load("no_such.manifest")
+    assert_equal(nil, lib2, "should fail to open manifest")
+    assert_match("failed to open manifest", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("dlopen options and prebind", function()
+    build_test_lib([[
+int twice(int x) { return x * 2; }
+int thrice(int x) { return x * 3; }
+]])
+    close_dso()
+    local lib = assert(dlopen("./libtest.so", {
+        lazy = true,
+        global = true,
+    }))
+    _DSO = lib
+    assert_true(lib:dlsym("int", "twice", "int"))
+    assert_true(lib:dlsym("int", "thrice", "int", {lazy = true}))
+    assert_equal(1, lib:prebind(), "should resolve the lazy symbol")
+    assert_equal(0, lib:prebind(), "should be no-op for resolved symbols")
+    assert_equal(4, lib:twice(2))
+    assert_equal(6, lib:thrice(2))
+    -- the missing symbol is reported by prebind instead of by dlsym
+    assert_true(lib:dlsym("int", "no_such_function", {lazy = true}),
+                "should not resolve at declaration")
+    local n, err = lib:prebind()
+    assert_equal(nil, n, "prebind should fail with missing symbol")
+    assert_match("failed to find symbol 'no_such_function'", err,
+                 "Wrong error message: " .. tostring(err))
+    assert_true(lib:dlclose())
+
+    local ok
+    ok, err = pcall(dlopen, "./libtest.so", "lazy")
+    assert_equal(false, ok, "non-table options should fail")
+    assert_match("table expected", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("lazy option resolves the symbol on the first call", function()
+    local lib = build_test_lib([[
+int inc(int x) { return x + 1; }
+]])
+    assert_true(lib:dlsym("int", "inc", "int", {lazy = true}))
+    assert_true(lib:dlsym("int", "no_such_function", {lazy = true}),
+                "should not resolve at declaration")
+    assert_equal(2, lib:inc(1))
+    assert_equal(3, lib:inc(2), "should use the resolved symbol")
+
+    local ok, err = pcall(function()
+        lib:no_such_function()
+    end)
+    assert_equal(false, ok, "missing symbol should fail on the call")
+    assert_match("failed to find symbol 'no_such_function'", err,
+                 "Wrong error message: " .. tostring(err))
+
+    local n
+    n, err = lib:prebind()
+    assert_equal(nil, n, "prebind should fail with missing symbol")
+    assert_match("no_such_function", err,
+                 "Wrong error message: " .. tostring(err))
+
+    local inc = lib:func("inc")
+    assert_true(lib:dlclose())
+    ok, err = pcall(inc, 1)
+    assert_equal(false, ok, "closed module should fail")
+    assert_match("module is closed", err,
+                 "Wrong error message: " .. tostring(err))
+end)
+
+run_test("symbols of the same signature share the call interface",
+         function()
+    local lib = build_test_lib([[
+int add(int a, int b) { return a + b; }
+int sub(int a, int b) { return a - b; }
+]])
+    assert_true(lib:dlsym("int", "add", "int", "int"))
+    assert_true(lib:dlsym("int", "sub", "int", "int"))
+    assert_equal(5, lib:add(2, 3))
+    assert_equal(-1, lib:sub(2, 3))
+
+    local lib2 = assert(dlopen("./libtest.so"))
+    assert_true(lib2:dlsym("int", "sub", "int", "int"))
+    assert_true(lib:dlclose())
+    assert_equal(1, lib2:sub(3, 2),
+                 "should keep the signature used by another module")
+    assert_true(lib2:dlclose())
+end)
+
 print("All dlopen tests passed!")
 
 -- Restore original working directory